@@ -0,0 +1,283 @@
+/* Copyright (c) 2016 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tlsf.h"
+
+#ifndef TLSF_MT
+#error bench-mt requires TLSF_MT
+#endif
+
+#define MAX_THREADS 64
+#define RING_SIZE 1024
+#define LAT_SAMPLES 4096
+#define LAT_INTERVAL 64
+
+/* SPSC ring carrying blocks from a producer thread to the consumer
+   that frees them remotely. */
+typedef struct {
+  _Atomic size_t head;
+  _Atomic size_t tail;
+  void* slot[RING_SIZE];
+} ring_t;
+
+typedef struct {
+  unsigned id;
+  unsigned nthreads;
+  size_t loops;
+  size_t blk_min, blk_max;
+  size_t num_blks;
+  unsigned cross; /* percent of frees handed to the neighbor */
+  bool pin;
+  tlsf_t t;
+  ring_t inbox;
+  unsigned seed;
+
+  /* Results. */
+  double elapsed;
+  size_t ops;
+  size_t remote_frees;
+  uint64_t lat[LAT_SAMPLES];
+  size_t lat_count;
+} worker_t;
+
+static worker_t workers[MAX_THREADS];
+
+static void* map(size_t* min_size, void* user) {
+  size_t spacelen = *(size_t*)user;
+  *min_size += spacelen;
+  return malloc(*min_size);
+}
+
+static void unmap(void* mem, size_t size, void* user) {
+  (void)size;
+  (void)user;
+  free(mem);
+}
+
+static bool ring_push(ring_t* r, void* p) {
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (head - tail == RING_SIZE)
+    return false;
+  r->slot[head % RING_SIZE] = p;
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+  return true;
+}
+
+static void* ring_pop(ring_t* r) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (head == tail)
+    return NULL;
+  void* p = r->slot[tail % RING_SIZE];
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+  return p;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Drain blocks other threads produced for us; they live in the
+   producer's arena, so they go back via the remote-free list. */
+static size_t drain_inbox(worker_t* w) {
+  size_t n = 0;
+  void* p;
+  while ((p = ring_pop(&w->inbox))) {
+    worker_t* owner = &workers[(w->id + w->nthreads - 1) % w->nthreads];
+    tlsf_free_remote(owner->t, p);
+    n++;
+  }
+  return n;
+}
+
+static void* run(void* arg) {
+  worker_t* w = (worker_t*)arg;
+
+  if (w->pin) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->id % (unsigned)sysconf(_SC_NPROCESSORS_ONLN), &set);
+    int err = sched_setaffinity(0, sizeof(set), &set);
+    assert(err == 0);
+  }
+
+  void** blk = (void**)calloc(w->num_blks, sizeof(void*));
+  assert(blk);
+  ring_t* outbox = &workers[(w->id + 1) % w->nthreads].inbox;
+
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < w->loops; i++) {
+    size_t idx = (size_t)rand_r(&w->seed) % w->num_blks;
+    size_t blk_size = w->blk_max > w->blk_min
+      ? w->blk_min + (size_t)rand_r(&w->seed) % (w->blk_max - w->blk_min)
+      : w->blk_min;
+
+    w->remote_frees += drain_inbox(w);
+
+    if (blk[idx]) {
+      /* Hand a share of the frees to the neighbor thread. */
+      if ((unsigned)rand_r(&w->seed) % 100 < w->cross
+          && ring_push(outbox, blk[idx]))
+        w->remote_frees++;
+      else
+        tlsf_free(w->t, blk[idx]);
+      blk[idx] = NULL;
+    }
+
+    if (i % LAT_INTERVAL == 0 && w->lat_count < LAT_SAMPLES) {
+      uint64_t t0 = now_ns();
+      blk[idx] = tlsf_malloc(w->t, blk_size);
+      w->lat[w->lat_count++] = now_ns() - t0;
+    } else {
+      blk[idx] = tlsf_malloc(w->t, blk_size);
+    }
+    assert(blk[idx]);
+    w->ops++;
+  }
+
+  /* Let the neighbor finish producing before the final drain. */
+  w->remote_frees += drain_inbox(w);
+  for (size_t i = 0; i < w->num_blks; i++)
+    if (blk[i])
+      tlsf_free(w->t, blk[i]);
+  free(blk);
+
+  w->elapsed = (double)(now_ns() - start) * 1e-9;
+  return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t* v, size_t n, unsigned p) {
+  return n ? v[(n - 1) * p / 100] : 0;
+}
+
+static void usage(const char* name) {
+  printf("run a multi-threaded malloc benchmark.\n"
+         "usage: %s [-t threads] [-x cross-free-percent] "
+         "[-s blk-size|blk-min:blk-max] [-l loop-count] [-n num-blocks] "
+         "[-p]\n",
+         name);
+  exit(-1);
+}
+
+int main(int argc, char** argv) {
+  unsigned nthreads = 4, cross = 10;
+  size_t blk_min = 512, blk_max = 512, num_blks = 10000;
+  size_t loops = 1000000;
+  bool pin = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:x:s:l:n:ph")) > 0) {
+    switch (opt) {
+    case 't':
+      nthreads = (unsigned)strtol(optarg, NULL, 0);
+      break;
+    case 'x':
+      cross = (unsigned)strtol(optarg, NULL, 0);
+      break;
+    case 's': {
+      char* endptr;
+      blk_min = blk_max = (size_t)strtol(optarg, &endptr, 0);
+      if (endptr && *endptr == ':')
+        blk_max = (size_t)strtol(endptr + 1, NULL, 0);
+      break;
+    }
+    case 'l':
+      loops = (size_t)strtol(optarg, NULL, 0);
+      break;
+    case 'n':
+      num_blks = (size_t)strtol(optarg, NULL, 0);
+      break;
+    case 'p':
+      pin = true;
+      break;
+    default:
+      usage(argv[0]);
+      break;
+    }
+  }
+  if (!nthreads || nthreads > MAX_THREADS || cross > 100 || blk_min > blk_max)
+    usage(argv[0]);
+
+  /* Size the first mapping to cover a worker's steady-state live set,
+     so the workers measure allocator throughput rather than pool
+     map/unmap churn. */
+  size_t spacelen = blk_max * num_blks;
+
+  for (unsigned i = 0; i < nthreads; i++) {
+    worker_t* w = &workers[i];
+    w->id = i;
+    w->nthreads = nthreads;
+    w->loops = loops;
+    w->blk_min = blk_min;
+    w->blk_max = blk_max;
+    w->num_blks = num_blks;
+    w->cross = cross;
+    w->pin = pin;
+    w->seed = i + 1;
+    w->t = tlsf_create(map, unmap, &spacelen);
+    assert(w->t);
+  }
+
+  pthread_t tid[MAX_THREADS];
+  for (unsigned i = 0; i < nthreads; i++) {
+    int err = pthread_create(&tid[i], NULL, run, &workers[i]);
+    assert(err == 0);
+  }
+  for (unsigned i = 0; i < nthreads; i++) {
+    int err = pthread_join(tid[i], NULL);
+    assert(err == 0);
+  }
+
+  /* Blocks pushed after a consumer's final drain are still in flight. */
+  for (unsigned i = 0; i < nthreads; i++) {
+    worker_t* w = &workers[i];
+    worker_t* owner = &workers[(i + nthreads - 1) % nthreads];
+    void* p;
+    while ((p = ring_pop(&w->inbox)))
+      tlsf_free(owner->t, p);
+  }
+
+  printf("threads=%u cross=%u%% blk=%lu-%lu loops=%lu pin=%d\n",
+         nthreads, cross, blk_min, blk_max, loops, pin);
+
+  double total_rate = 0;
+  for (unsigned i = 0; i < nthreads; i++) {
+    worker_t* w = &workers[i];
+    qsort(w->lat, w->lat_count, sizeof(uint64_t), cmp_u64);
+    double rate = (double)w->ops / w->elapsed;
+    total_rate += rate;
+    printf("thread %2u: %.0f ops/s, remote_frees=%lu, "
+           "latency p50=%luns p90=%luns p99=%luns max=%luns\n",
+           i, rate, w->remote_frees,
+           percentile(w->lat, w->lat_count, 50),
+           percentile(w->lat, w->lat_count, 90),
+           percentile(w->lat, w->lat_count, 99),
+           w->lat_count ? w->lat[w->lat_count - 1] : 0);
+    tlsf_destroy(w->t);
+  }
+  printf("total: %.0f ops/s\n", total_rate);
+
+  return 0;
+}
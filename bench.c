@@ -17,10 +17,27 @@
 
 static tlsf_t t;
 
+/* The workload runs through these, so the identical sequence of
+   operations can be replayed against the system allocator with
+   -b libc for a side-by-side comparison. */
+static void* (*xmalloc)(size_t size);
+static void  (*xfree)(void* mem);
+static void* (*xrealloc)(void* mem, size_t size);
+
+static void* tlsf_malloc_wrap(size_t size) { return tlsf_malloc(t, size); }
+static void  tlsf_free_wrap(void* mem) { tlsf_free(t, mem); }
+static void* tlsf_realloc_wrap(void* mem, size_t size) {
+  return tlsf_realloc(t, mem, size);
+}
+
 static void usage(const char *name) {
   printf("run a malloc benchmark.\n"
          "usage: %s [-s blk-size|blk-min:blk-max] [-l loop-count] "
-         "[-n num-blocks] [-c]\n",
+         "[-n num-blocks] [-w mix|slab|realloc|bimodal|ramp] [-b libc] "
+         "[-c] [-j]\n"
+         "  -w  named workload preset (default: mix)\n"
+         "  -b  baseline allocator to compare against (libc)\n"
+         "  -j  machine-readable JSON output\n",
          name);
   exit(-1);
 }
@@ -61,8 +78,20 @@ static size_t get_random_block_size(size_t blk_min, size_t blk_max) {
   return blk_min;
 }
 
-static void run_alloc_benchmark(size_t loops, size_t blk_min, size_t blk_max,
-                                void **blk_array, size_t num_blks, bool clear) {
+/* Free whatever the workload left behind. */
+static void free_all_blocks(void **blk_array, size_t num_blks) {
+  for (size_t i = 0; i < num_blks; i++) {
+    if (blk_array[i]) {
+      xfree(blk_array[i]);
+      blk_array[i] = NULL;
+    }
+  }
+}
+
+/* The historical default: random sizes, mostly free+malloc with an
+   occasional realloc. */
+static void run_mix(size_t loops, size_t blk_min, size_t blk_max,
+                    void **blk_array, size_t num_blks, bool clear) {
   while (loops--) {
     size_t next_idx = (size_t)rand() % num_blks;
     size_t blk_size = get_random_block_size(blk_min, blk_max);
@@ -70,30 +99,106 @@ static void run_alloc_benchmark(size_t loops, size_t blk_min, size_t blk_max,
     if (blk_array[next_idx]) {
       if (rand() % 10 == 0) {
         /* Insert the newly alloced block into the array at a random point. */
-        blk_array[next_idx] = tlsf_realloc(t, blk_array[next_idx], blk_size);
+        blk_array[next_idx] = xrealloc(blk_array[next_idx], blk_size);
       } else {
-        tlsf_free(t, blk_array[next_idx]);
+        xfree(blk_array[next_idx]);
         /* Insert the newly alloced block into the array at a random point. */
-        blk_array[next_idx] = tlsf_malloc(t, blk_size);
+        blk_array[next_idx] = xmalloc(blk_size);
       }
     } else {
       /* Insert the newly alloced block into the array at a random point. */
-      blk_array[next_idx] = tlsf_malloc(t, blk_size);
+      blk_array[next_idx] = xmalloc(blk_size);
     }
     if (clear)
       memset(blk_array[next_idx], 0, blk_size);
 
 #ifdef TLSF_STATS
-    if (loops % 100000 == 0)
+    if (t && loops % 100000 == 0)
       tlsf_printstats(t);
 #endif
   }
 
-  /* Free up all allocated blocks. */
-  for (size_t i = 0; i < num_blks; i++) {
-    if (blk_array[i])
-      tlsf_free(t, blk_array[i]);
+  free_all_blocks(blk_array, num_blks);
+}
+
+/* Slab-like: a handful of fixed sizes, chosen by slot, pure
+   malloc/free churn. Exercises the small-class caches. */
+static void run_slab(size_t loops, void **blk_array, size_t num_blks,
+                     bool clear) {
+  static const size_t sizes[] = { 64, 128, 256, 512 };
+
+  while (loops--) {
+    size_t next_idx = (size_t)rand() % num_blks;
+    size_t blk_size = sizes[next_idx % 4];
+
+    if (blk_array[next_idx]) {
+      xfree(blk_array[next_idx]);
+      blk_array[next_idx] = NULL;
+    } else {
+      blk_array[next_idx] = xmalloc(blk_size);
+      if (clear)
+        memset(blk_array[next_idx], 0, blk_size);
+    }
+  }
+
+  free_all_blocks(blk_array, num_blks);
+}
+
+/* Realloc-heavy: every operation resizes a live block (or creates one
+   through realloc(NULL)). Exercises in-place growth and the copy path. */
+static void run_realloc(size_t loops, size_t blk_min, size_t blk_max,
+                        void **blk_array, size_t num_blks, bool clear) {
+  while (loops--) {
+    size_t next_idx = (size_t)rand() % num_blks;
+    size_t blk_size = get_random_block_size(blk_min, blk_max);
+
+    blk_array[next_idx] = xrealloc(blk_array[next_idx], blk_size);
+    if (clear)
+      memset(blk_array[next_idx], 0, blk_size);
   }
+
+  free_all_blocks(blk_array, num_blks);
+}
+
+/* Bimodal: mostly small blocks with an occasional large one, the
+   shape of a metadata-heavy server heap. */
+static void run_bimodal(size_t loops, void **blk_array, size_t num_blks,
+                        bool clear) {
+  while (loops--) {
+    size_t next_idx = (size_t)rand() % num_blks;
+    size_t blk_size = rand() % 10
+      ? 16 + (size_t)rand() % 240
+      : 8192 + (size_t)rand() % 57344;
+
+    if (blk_array[next_idx]) {
+      xfree(blk_array[next_idx]);
+      blk_array[next_idx] = NULL;
+    } else {
+      blk_array[next_idx] = xmalloc(blk_size);
+      if (clear)
+        memset(blk_array[next_idx], 0, blk_size);
+    }
+  }
+
+  free_all_blocks(blk_array, num_blks);
+}
+
+/* Ramp: fill every slot, then drain them all, repeatedly. The live
+   set swings between zero and the maximum, exercising the pool
+   map/unmap (and standby) transitions. */
+static void run_ramp(size_t loops, size_t blk_min, size_t blk_max,
+                     void **blk_array, size_t num_blks, bool clear) {
+  while (loops) {
+    for (size_t i = 0; i < num_blks && loops; i++, loops--) {
+      size_t blk_size = get_random_block_size(blk_min, blk_max);
+      blk_array[i] = xmalloc(blk_size);
+      if (clear)
+        memset(blk_array[i], 0, blk_size);
+    }
+    free_all_blocks(blk_array, num_blks);
+  }
+
+  free_all_blocks(blk_array, num_blks);
 }
 
 static void* map(size_t* min_size, void* user) {
@@ -104,13 +209,21 @@ static void* map(size_t* min_size, void* user) {
   return p;
 }
 
+static void unmap(void* mem, size_t size, void* user) {
+  (void)size;
+  (void)user;
+  free(mem);
+}
+
 int main(int argc, char **argv) {
   size_t blk_min = 512, blk_max = 512, num_blks = 10000;
   size_t loops = 10000000;
-  bool clear = false;
+  const char *workload = "mix";
+  const char *baseline = NULL;
+  bool clear = false, json = false;
   int opt;
 
-  while ((opt = getopt(argc, argv, "s:l:r:t:n:b:ch")) > 0) {
+  while ((opt = getopt(argc, argv, "s:l:n:w:b:cjh")) > 0) {
     switch (opt) {
     case 's':
       parse_size_arg(optarg, argv[0], &blk_min, &blk_max);
@@ -121,9 +234,18 @@ int main(int argc, char **argv) {
     case 'n':
       num_blks = parse_int_arg(optarg, argv[0]);
       break;
+    case 'w':
+      workload = optarg;
+      break;
+    case 'b':
+      baseline = optarg;
+      break;
     case 'c':
       clear = true;
       break;
+    case 'j':
+      json = true;
+      break;
     case 'h':
       usage(argv[0]);
       break;
@@ -133,8 +255,21 @@ int main(int argc, char **argv) {
     }
   }
 
-  size_t spacelen = blk_max * num_blks;
-  t = tlsf_create(map, 0, &spacelen);
+  if (baseline) {
+    if (strcmp(baseline, "libc"))
+      usage(argv[0]);
+    xmalloc = malloc;
+    xfree = free;
+    xrealloc = realloc;
+  } else {
+    size_t spacelen = blk_max * num_blks;
+    /* The ramp preset measures the map/unmap path itself; keep the
+       callback so drained pools actually go back. */
+    t = tlsf_create(map, strcmp(workload, "ramp") ? 0 : unmap, &spacelen);
+    xmalloc = tlsf_malloc_wrap;
+    xfree = tlsf_free_wrap;
+    xrealloc = tlsf_realloc_wrap;
+  }
 
   void** blk_array = (void**)calloc(num_blks, sizeof(void*));
   assert(blk_array);
@@ -144,10 +279,21 @@ int main(int argc, char **argv) {
   int err = clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
   assert(err == 0);
 
-  printf("blk_min=%lu to blk_max=%lu\n", blk_min, blk_max);
+  if (!json)
+    printf("blk_min=%lu to blk_max=%lu\n", blk_min, blk_max);
 
-  run_alloc_benchmark(loops, blk_min, blk_max,
-                      blk_array, num_blks, clear);
+  if (!strcmp(workload, "mix"))
+    run_mix(loops, blk_min, blk_max, blk_array, num_blks, clear);
+  else if (!strcmp(workload, "slab"))
+    run_slab(loops, blk_array, num_blks, clear);
+  else if (!strcmp(workload, "realloc"))
+    run_realloc(loops, blk_min, blk_max, blk_array, num_blks, clear);
+  else if (!strcmp(workload, "bimodal"))
+    run_bimodal(loops, blk_array, num_blks, clear);
+  else if (!strcmp(workload, "ramp"))
+    run_ramp(loops, blk_min, blk_max, blk_array, num_blks, clear);
+  else
+    usage(argv[0]);
 
   err = clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
   assert(err == 0);
@@ -155,17 +301,43 @@ int main(int argc, char **argv) {
 
   double elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
 
-  struct rusage usage;
-  err = getrusage(RUSAGE_SELF, &usage);
+  struct rusage usage_;
+  err = getrusage(RUSAGE_SELF, &usage_);
   assert(err == 0);
 
-  tlsf_destroy(t);
+#ifdef TLSF_STATS
+  tlsf_stats_t stats = { 0 };
+  if (t)
+    stats = *tlsf_stats(t);
+#endif
+
+  if (t)
+    tlsf_destroy(t);
 
-  /* Dump both machine and human readable versions */
-  printf("%lu:%lu:%lu:%u:%lu:%.6f: took %.6f s for %lu malloc/free\nbenchmark loops of %lu-%lu bytes.  ~%.3f us per loop\n",
-         blk_min, blk_max, loops,
-         clear, usage.ru_maxrss, elapsed, elapsed, loops, blk_min,
-         blk_max, elapsed / (double)loops * 1e6);
+  if (json) {
+    printf("{\"workload\":\"%s\",\"allocator\":\"%s\","
+           "\"blk_min\":%lu,\"blk_max\":%lu,\"num_blks\":%lu,"
+           "\"loops\":%lu,\"clear\":%s,"
+           "\"elapsed_s\":%.6f,\"ns_per_op\":%.1f,\"maxrss_kb\":%lu",
+           workload, baseline ? baseline : "tlsf",
+           blk_min, blk_max, num_blks, loops, clear ? "true" : "false",
+           elapsed, elapsed / (double)loops * 1e9, usage_.ru_maxrss);
+#ifdef TLSF_STATS
+    if (!baseline)
+      printf(",\"stats\":{\"free_size\":%lu,\"used_size\":%lu,"
+             "\"total_size\":%lu,\"pool_count\":%lu,"
+             "\"malloc_count\":%lu,\"free_count\":%lu}",
+             stats.free_size, stats.used_size, stats.total_size,
+             stats.pool_count, stats.malloc_count, stats.free_count);
+#endif
+    printf("}\n");
+  } else {
+    /* Dump both machine and human readable versions */
+    printf("%lu:%lu:%lu:%u:%lu:%.6f: took %.6f s for %lu malloc/free\nbenchmark loops of %lu-%lu bytes.  ~%.3f us per loop\n",
+           blk_min, blk_max, loops,
+           clear, usage_.ru_maxrss, elapsed, elapsed, loops, blk_min,
+           blk_max, elapsed / (double)loops * 1e6);
+  }
 
   return 0;
 }
@@ -0,0 +1,220 @@
+/* Copyright (c) 2016 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license.
+ */
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "tlsf.h"
+
+#ifndef TLSF_TRACE
+#error replay requires TLSF_TRACE
+#endif
+
+/* Open-addressing map from recorded pointers to live pointers. */
+typedef struct {
+  size_t* key;
+  void** val;
+  size_t mask;
+  size_t used;
+} map_t;
+
+static void map_init(map_t* m, size_t pow2) {
+  m->mask = pow2 - 1;
+  m->used = 0;
+  m->key = (size_t*)calloc(pow2, sizeof(size_t));
+  m->val = (void**)calloc(pow2, sizeof(void*));
+  assert(m->key && m->val);
+}
+
+static void map_put(map_t* m, size_t key, void* val);
+
+static void map_grow(map_t* m) {
+  map_t old = *m;
+  map_init(m, 2 * (old.mask + 1));
+  for (size_t i = 0; i <= old.mask; i++)
+    if (old.key[i])
+      map_put(m, old.key[i], old.val[i]);
+  free(old.key);
+  free(old.val);
+}
+
+static void map_put(map_t* m, size_t key, void* val) {
+  if (m->used > m->mask - m->mask / 4)
+    map_grow(m);
+  size_t i = key & m->mask;
+  while (m->key[i] && m->key[i] != key)
+    i = (i + 1) & m->mask;
+  if (!m->key[i])
+    m->used++;
+  m->key[i] = key;
+  m->val[i] = val;
+}
+
+static void* map_remove(map_t* m, size_t key) {
+  size_t i = key & m->mask;
+  while (m->key[i] != key) {
+    if (!m->key[i])
+      return NULL;
+    i = (i + 1) & m->mask;
+  }
+  void* val = m->val[i];
+
+  /* Re-insert the rest of the cluster to keep probing intact. */
+  m->key[i] = 0;
+  m->used--;
+  for (size_t j = (i + 1) & m->mask; m->key[j]; j = (j + 1) & m->mask) {
+    size_t k = m->key[j];
+    void* v = m->val[j];
+    m->key[j] = 0;
+    m->used--;
+    map_put(m, k, v);
+  }
+  return val;
+}
+
+static void map_clear(map_t* m) {
+  memset(m->key, 0, (m->mask + 1) * sizeof(size_t));
+  m->used = 0;
+}
+
+static void* map_pages(size_t* min_size, void* user) {
+  (void)user;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  *min_size = page * ((*min_size + page - 1UL) / page);
+  void* p = mmap(0, *min_size, PROT_READ | PROT_WRITE,
+                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  assert(p != (void*)(-1));
+  return p;
+}
+
+static void unmap_pages(void* p, size_t s, void* user) {
+  (void)user;
+  int ret = munmap(p, s);
+  assert(ret == 0);
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    printf("replay a trace recorded with tlsf_trace_start.\n"
+           "usage: %s trace-file\n",
+           argv[0]);
+    return -1;
+  }
+
+  FILE* f = fopen(argv[1], "rb");
+  if (!f) {
+    perror(argv[1]);
+    return -1;
+  }
+
+  tlsf_trace_header_t header;
+  if (fread(&header, sizeof(header), 1, f) != 1
+      || header.magic != TLSF_TRACE_MAGIC
+      || header.version != TLSF_TRACE_VERSION
+      || header.wordsize != __WORDSIZE) {
+    fprintf(stderr, "%s: not a compatible trace file\n", argv[1]);
+    return -1;
+  }
+
+  tlsf_t t = tlsf_create(map_pages, unmap_pages, NULL);
+  assert(t);
+
+  map_t live;
+  map_init(&live, 1 << 16);
+
+  const size_t opshift = __WORDSIZE - 8;
+  const size_t sizemask = ((size_t)1 << opshift) - 1;
+  size_t ops = 0, unmatched = 0;
+
+  struct timespec start, end;
+  int err = clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+  assert(err == 0);
+
+  tlsf_trace_event_t ev[4096];
+  size_t n;
+  while ((n = fread(ev, sizeof(ev[0]), 4096, f)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      const unsigned op = (unsigned)(ev[i].size_op >> opshift);
+      const size_t size = ev[i].size_op & sizemask;
+      switch (op) {
+      case TLSF_TRACE_MALLOC: {
+        void* p = tlsf_malloc(t, size);
+        assert(p);
+        map_put(&live, ev[i].ptr, p);
+        break;
+      }
+      case TLSF_TRACE_FREE: {
+        void* p = map_remove(&live, ev[i].ptr);
+        if (p)
+          tlsf_free(t, p);
+        else
+          unmatched++;
+        break;
+      }
+      case TLSF_TRACE_REALLOC: {
+        void* p = map_remove(&live, ev[i].ptr);
+        if (!p) {
+          unmatched++;
+          break;
+        }
+        p = tlsf_realloc(t, p, size);
+        assert(p);
+        map_put(&live, ev[i].ptr2, p);
+        break;
+      }
+      case TLSF_TRACE_FREE_ALL: {
+        tlsf_free_all(t);
+        map_clear(&live);
+        break;
+      }
+      default:
+        fprintf(stderr, "corrupt event %lu\n", ops);
+        return -1;
+      }
+      ops++;
+    }
+  }
+  fclose(f);
+
+  err = clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+  assert(err == 0);
+  double elapsed = (double)(end.tv_sec - start.tv_sec)
+    + (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+
+  struct rusage usage;
+  err = getrusage(RUSAGE_SELF, &usage);
+  assert(err == 0);
+
+  printf("%lu events in %.6f s, %.0f events/s, %lu live blocks at end, "
+         "%lu unmatched, maxrss=%lukb\n",
+         ops, elapsed, (double)ops / elapsed, live.used, unmatched,
+         usage.ru_maxrss);
+
+#ifdef TLSF_STATS
+  const tlsf_stats_t* s = tlsf_stats(t);
+  printf("free_size=%lu used_size=%lu total_size=%lu pool_count=%lu "
+         "fragmentation=%.1f%%\n",
+         s->free_size, s->used_size, s->total_size, s->pool_count,
+         s->total_size
+           ? 100.0 * (double)s->free_size / (double)s->total_size : 0.0);
+#endif
+
+  /* Free the survivors so the leak checks in tlsf_destroy hold. */
+  for (size_t i = 0; i <= live.mask; i++)
+    if (live.key[i])
+      tlsf_free(t, live.val[i]);
+  free(live.key);
+  free(live.val);
+
+  tlsf_destroy(t);
+  return 0;
+}
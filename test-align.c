@@ -0,0 +1,62 @@
+/* Copyright (c) 2016 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license.
+ */
+
+/*
+ * Compiled with -DTLSF_PREFIX=tlsf_a32_ -DALIGN_SIZE_SHIFT=5 (see
+ * Makefile) against a matching build of tlsf.c, exercising the
+ * 32-byte-aligned specialization linked into the same binary as the
+ * word-aligned allocator used by test.c.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tlsf.h"
+
+static void* a32_map(size_t* min_size, void* user) {
+  (void)user;
+  *min_size = (*min_size + 64 * 1024) & ~(size_t)4095;
+  void* p = aligned_alloc(4096, *min_size);
+  assert(p);
+  return p;
+}
+
+static void a32_unmap(void* p, size_t s, void* user) {
+  (void)user;
+  (void)s;
+  free(p);
+}
+
+void alignment_geometry_test(void) {
+  tlsf_t t = tlsf_create(a32_map, a32_unmap, NULL);
+  assert(t != NULL);
+
+  void* p[256];
+  for (unsigned i = 0; i < 256; i++) {
+    p[i] = tlsf_malloc(t, (size_t)rand() % 2000 + 1);
+    assert(p[i]);
+    assert((size_t)p[i] % 32 == 0);
+    memset(p[i], 0x6b, 16);
+  }
+  for (unsigned i = 0; i < 256; i += 2)
+    tlsf_free(t, p[i]);
+  for (unsigned i = 0; i < 256; i += 2) {
+    p[i] = tlsf_realloc(t, p[i + 1], 3000);
+    assert(p[i]);
+    assert((size_t)p[i] % 32 == 0);
+  }
+
+  // Stricter requests still go through the gap-splitting path.
+  void* q = tlsf_memalign(t, 256, 1000);
+  assert(q && (size_t)q % 256 == 0);
+  tlsf_free(t, q);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  for (unsigned i = 0; i < 256; i += 2)
+    tlsf_free(t, p[i]);
+  tlsf_destroy(t);
+}
@@ -0,0 +1,62 @@
+/* Copyright (c) 2016 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license.
+ */
+
+/*
+ * Compiled with -DTLSF_PREFIX=tlsf_small_ -DTLSF_MAX_SHIFT=21
+ * -DSL_INDEX_COUNT_SHIFT=4 (see Makefile) against a matching build of
+ * tlsf.c, exercising a compact specialization linked into the same
+ * binary as the full-size allocator used by test.c.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tlsf.h"
+
+static void* small_map(size_t* min_size, void* user) {
+  (void)user;
+  *min_size += 64 * 1024;
+  void* p = malloc(*min_size);
+  assert(p);
+  return p;
+}
+
+static void small_unmap(void* p, size_t s, void* user) {
+  (void)user;
+  (void)s;
+  free(p);
+}
+
+void small_geometry_test(void) {
+  static_assert(TLSF_MAX_SIZE == (1ULL << 21) - sizeof (size_t),
+                "wrong specialized geometry");
+
+  tlsf_t t = tlsf_create(small_map, small_unmap, NULL);
+  assert(t != NULL);
+
+  void* p[256];
+  for (unsigned i = 0; i < 256; i++) {
+    p[i] = tlsf_malloc(t, (size_t)rand() % 2000 + 1);
+    assert(p[i]);
+    memset(p[i], 0x5a, 16);
+  }
+  for (unsigned i = 0; i < 256; i += 2)
+    tlsf_free(t, p[i]);
+  for (unsigned i = 0; i < 256; i += 2) {
+    p[i] = tlsf_realloc(t, p[i + 1], 3000);
+    assert(p[i]);
+  }
+
+  tlsf_frag_t frag;
+  tlsf_fragmentation(t, &frag);
+  assert(frag.pool_count >= 1);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  for (unsigned i = 0; i < 256; i += 2)
+    tlsf_free(t, p[i]);
+  tlsf_destroy(t);
+}
@@ -10,6 +10,9 @@
 #include <unistd.h>
 #include <time.h>
 #include <assert.h>
+#ifdef TLSF_LOCK
+#include <pthread.h>
+#endif
 #include <sys/mman.h>
 #include "tlsf.h"
 
@@ -81,7 +84,7 @@ static void random_test(size_t spacelen, const size_t cap) {
       memset(data, 0, len);
     data[0] = 0xa5;
 
-    if (i++ == maxitems)
+    if (++i == maxitems)
       break;
   }
 
@@ -173,8 +176,1131 @@ static void large_size_test(bool large_pool) {
   tlsf_destroy(t);
 }
 
+#ifdef TLSF_TRACE
+#include <fcntl.h>
+
+static void trace_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  int fd = open("build/test-trace.bin", O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  assert(fd >= 0);
+  int err = tlsf_trace_start(t, fd);
+  assert(err == 0);
+
+  void* p[512];
+  for (unsigned i = 0; i < 512; i++)
+    p[i] = tlsf_malloc(t, (size_t)rand() % 2000 + 1);
+  for (unsigned i = 0; i < 512; i += 2)
+    p[i] = tlsf_realloc(t, p[i], (size_t)rand() % 4000 + 1);
+  for (unsigned i = 0; i < 512; i++)
+    tlsf_free(t, p[i]);
+
+  tlsf_trace_stop(t);
+  tlsf_destroy(t);
+
+  // Header plus at least one event per operation.
+  off_t len = lseek(fd, 0, SEEK_END);
+  assert((size_t)len >= sizeof(tlsf_trace_header_t)
+         + 1024 * sizeof(tlsf_trace_event_t));
+  close(fd);
+}
+#endif
+
+static void grow_test(void) {
+  size_t spacelen = 4 * 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  // Append-style growth: the buffer must survive every extension.
+  size_t len = 16;
+  uint8_t* p = (uint8_t*)tlsf_malloc(t, len);
+  assert(p);
+  memset(p, 0xa5, len);
+
+  unsigned moves = 0;
+  for (unsigned i = 0; i < 64; i++) {
+    size_t newlen = len + 100;
+    uint8_t* q = (uint8_t*)tlsf_reallocx(t, p, newlen, TLSF_GROW);
+    assert(q);
+    if (q != p)
+      moves++;
+    assert(q[0] == 0xa5 && q[len - 1] == 0xa5);
+    memset(q, 0xa5, newlen);
+    p = q;
+    len = newlen;
+
+#ifdef TLSF_DEBUG
+    tlsf_check(t);
+#endif
+  }
+
+  // The headroom should make in-place extension the common case.
+  assert(moves < 16);
+
+  tlsf_free(t, p);
+  tlsf_destroy(t);
+}
+
+static void metrics_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  tlsf_metrics_sample(t, 16);
+
+  void* p[1024];
+  for (unsigned i = 0; i < 1024; i++) {
+    p[i] = tlsf_malloc(t, (size_t)rand() % 2000 + 1);
+    assert(p[i]);
+  }
+  for (unsigned i = 0; i < 1024; i++)
+    tlsf_free(t, p[i]);
+
+  // Larger than the pool, so the slow path must map.
+  void* big = tlsf_malloc(t, 2 * spacelen);
+  assert(big);
+  tlsf_free(t, big);
+
+  const tlsf_metrics_t* m = tlsf_metrics(t);
+  assert(m->malloc_samples >= 1024 / 16);
+  assert(m->free_samples >= 1024 / 16);
+  assert(m->map_calls > 0);
+
+  // The samples must all have landed in the histograms.
+  size_t mallocs = 0, frees = 0;
+  for (unsigned i = 0; i < TLSF_METRICS_BUCKETS; i++) {
+    mallocs += m->malloc_hist[i];
+    frees += m->free_hist[i];
+  }
+  assert(mallocs == m->malloc_samples);
+  assert(frees == m->free_samples);
+
+#ifdef TLSF_STATS
+  size_t searches = 0, hits, misses;
+  for (unsigned fl = 0; tlsf_class_stats(t, fl, 0, &hits, &misses); fl++)
+    for (unsigned sl = 0; tlsf_class_stats(t, fl, sl, &hits, &misses); sl++)
+      searches += hits + misses;
+  assert(searches > 0);
+  assert(!tlsf_class_stats(t, ~0U, 0, &hits, &misses));
+#endif
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  tlsf_destroy(t);
+}
+
+static bool all_zero(const uint8_t* p, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    if (p[i])
+      return false;
+  return true;
+}
+
+static void create_mmap_test(void) {
+  static const int flags[]
+    = {0, TLSF_MMAP_HUGEPAGE, TLSF_MMAP_HUGETLB};
+
+  for (unsigned f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+    tlsf_t t = tlsf_create_mmap(flags[f]);
+    assert(t != NULL);
+
+    void* p[128];
+    for (unsigned i = 0; i < 128; i++) {
+      size_t len = (size_t)rand() % (128 * 1024) + 1;
+      p[i] = tlsf_calloc(t, len);
+      assert(p[i]);
+      memset(p[i], 0x7e, len < 64 ? len : 64);
+    }
+    for (unsigned i = 0; i < 128; i++)
+      tlsf_free(t, p[i]);
+
+#ifdef TLSF_DEBUG
+    tlsf_check(t);
+#endif
+
+    tlsf_destroy(t);
+  }
+}
+
+static void decommit_test(void) {
+  size_t spacelen = 16 * 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  // Leave a multi-megabyte free block pinned inside a live pool.
+  void* keep = tlsf_malloc(t, 64);
+  void* big = tlsf_malloc(t, 8 * 1024 * 1024);
+  assert(keep && big);
+  memset(big, 0xd6, 8 * 1024 * 1024);
+  tlsf_free(t, big);
+
+  size_t released = tlsf_decommit(t, 0);
+  assert(released >= 4 * 1024 * 1024);
+  assert(tlsf_decommit(t, ~(size_t)0) == 0);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  // The decommitted block must still be allocatable and writable.
+  big = tlsf_malloc(t, 8 * 1024 * 1024);
+  assert(big);
+  memset(big, 0x3c, 8 * 1024 * 1024);
+
+  tlsf_free(t, big);
+  tlsf_free(t, keep);
+  tlsf_destroy(t);
+}
+
+static void free_all_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+  tlsf_defer(t, 1);
+
+  for (unsigned round = 0; round < 8; round++) {
+    // A request's worth of allocations, spilling into extra pools,
+    // with enough frees to populate the cache and the deferred list.
+    void* p[256];
+    for (unsigned i = 0; i < 256; i++) {
+      p[i] = tlsf_malloc(t, (size_t)rand() % (32 * 1024) + 1);
+      assert(p[i]);
+    }
+    for (unsigned i = 0; i < 256; i += 3)
+      tlsf_free(t, p[i]);
+
+    tlsf_free_all(t);
+
+#ifdef TLSF_DEBUG
+    tlsf_check(t);
+#endif
+
+    // Every pool is maximally free again.
+    tlsf_frag_t frag;
+    tlsf_fragmentation(t, &frag);
+    assert(frag.free_blocks == frag.pool_count);
+
+    void* big = tlsf_malloc(t, spacelen / 2);
+    assert(big);
+    tlsf_free(t, big);
+  }
+
+  tlsf_destroy(t);
+}
+
+static void direct_test(void) {
+  tlsf_t t = tlsf_create(tlsf_map_large, tlsf_unmap_large, NULL);
+  assert(t != NULL);
+  tlsf_direct(t, 1024 * 1024);
+
+  // Far above the threshold: served by a dedicated mapping.
+  size_t len = 64 * 1024 * 1024;
+  uint8_t* p = (uint8_t*)tlsf_mallocx(t, len, TLSF_ZERO);
+  assert(p);
+  assert(tlsf_usable_size(t, p) >= len);
+  assert(all_zero(p, 4096) && all_zero(p + len - 4096, 4096));
+  p[0] = 1;
+  p[len - 1] = 2;
+
+  // The pools must not have grown to fit it.
+  tlsf_frag_t frag;
+  tlsf_fragmentation(t, &frag);
+  assert(frag.largest_free < len);
+
+  // Shrinking keeps the mapping, growing moves it by copy.
+  uint8_t* q = (uint8_t*)tlsf_realloc(t, p, len / 2);
+  assert(q == p);
+  q = (uint8_t*)tlsf_realloc(t, q, 2 * len);
+  assert(q && q[0] == 1);
+  q[2 * len - 1] = 3;
+  tlsf_free(t, q);
+
+  // Below the threshold the regular path still serves.
+  void* s = tlsf_malloc(t, 1000);
+  assert(s);
+  tlsf_free(t, s);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  tlsf_destroy(t);
+}
+
+static void zeromap_test(void) {
+  tlsf_t t = tlsf_create(tlsf_map_large, tlsf_unmap_large, NULL);
+  assert(t != NULL);
+  tlsf_zeromap(t, 1);
+
+  // Force a fresh pool so the blocks are carved from virgin pages.
+  void* p[64];
+  for (unsigned i = 0; i < 64; i++) {
+    p[i] = tlsf_calloc(t, 64 * 1024);
+    assert(p[i]);
+    assert(all_zero((uint8_t*)p[i], 64 * 1024));
+    memset(p[i], 0xff, 64 * 1024);
+  }
+
+  // Recycled blocks are dirty and must take the full memset.
+  for (unsigned i = 0; i < 64; i++)
+    tlsf_free(t, p[i]);
+  for (unsigned i = 0; i < 64; i++) {
+    p[i] = tlsf_calloc(t, 64 * 1024);
+    assert(p[i]);
+    assert(all_zero((uint8_t*)p[i], 64 * 1024));
+  }
+  for (unsigned i = 0; i < 64; i++)
+    tlsf_free(t, p[i]);
+
+  size_t n = tlsf_malloc_bulk(t, 300, p, 64, TLSF_ZERO);
+  assert(n == 64);
+  for (unsigned i = 0; i < 64; i++)
+    assert(all_zero((uint8_t*)p[i], 300));
+  tlsf_free_bulk(t, p, 64);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  tlsf_destroy(t);
+}
+
+typedef struct {
+  size_t pools;
+  size_t used;
+  size_t free;
+  size_t free_size;
+} walk_count_t;
+
+static void count_blocks(void* mem, size_t size, int kind, void* user) {
+  walk_count_t* c = (walk_count_t*)user;
+  assert(mem && size);
+  switch (kind) {
+  case TLSF_WALK_POOL: c->pools++; break;
+  case TLSF_WALK_USED: c->used++; break;
+  case TLSF_WALK_FREE: c->free++; c->free_size += size; break;
+  default: assert(!"unknown walk kind");
+  }
+}
+
+static void walk_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  // Sizes above the small-block caches, so a free really frees.
+  void* p[64];
+  for (unsigned i = 0; i < 64; i++) {
+    p[i] = tlsf_malloc(t, 1024 + (size_t)rand() % 4096);
+    assert(p[i]);
+  }
+  // Punch holes so free blocks cannot all coalesce.
+  for (unsigned i = 0; i < 64; i += 2)
+    tlsf_free(t, p[i]);
+
+  walk_count_t c = {0, 0, 0, 0};
+  tlsf_walk(t, count_blocks, &c);
+  assert(c.pools >= 1);
+  assert(c.used >= 32);
+  assert(c.free >= 32);
+
+  tlsf_frag_t frag;
+  tlsf_fragmentation(t, &frag);
+  assert(frag.pool_count == c.pools);
+  assert(frag.free_blocks == c.free);
+  assert(frag.free_size == c.free_size);
+  assert(frag.largest_free > 0 && frag.largest_free <= frag.free_size);
+
+  size_t blocks = 0;
+  for (unsigned i = 0; i < TLSF_FRAG_BUCKETS; i++)
+    blocks += frag.free_hist[i];
+  assert(blocks == frag.free_blocks);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  for (unsigned i = 1; i < 64; i += 2)
+    tlsf_free(t, p[i]);
+  tlsf_destroy(t);
+}
+
+static void usable_size_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  for (unsigned i = 0; i < 100; i++) {
+    size_t len = ((size_t)rand() % 5000) + 1;
+    size_t usable = 0;
+    void* p = tlsf_mallocx_ex(t, len, TLSF_DEFAULT, &usable);
+    assert(p);
+    assert(usable >= len);
+    assert(usable == tlsf_usable_size(t, p));
+
+    // The whole granted size must be writable.
+    memset(p, 0xa5, usable);
+    tlsf_free(t, p);
+  }
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  tlsf_destroy(t);
+}
+
+static void memalign_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  for (size_t align = 8; align <= 4096; align *= 2) {
+    void* p[32];
+    for (unsigned i = 0; i < 32; i++) {
+      size_t len = ((size_t)rand() % 500) + 1;
+      p[i] = tlsf_memalign(t, align, len);
+      assert(p[i]);
+      assert((size_t)p[i] % align == 0);
+      memset(p[i], 0xa5, len);
+    }
+
+#ifdef TLSF_DEBUG
+    tlsf_check(t);
+#endif
+
+    for (unsigned i = 0; i < 32; i++)
+      tlsf_free(t, p[i]);
+
+#ifdef TLSF_DEBUG
+    tlsf_check(t);
+#endif
+  }
+
+  tlsf_destroy(t);
+}
+
+typedef struct {
+  char* base;
+  size_t cap;
+  size_t used;
+  unsigned maps;
+  unsigned extends;
+} extend_user_t;
+
+static void* tlsf_map_once(size_t* min_size, void* user) {
+  extend_user_t* e = (extend_user_t*)user;
+  if (e->used)
+    return NULL; // force the extend path after the initial mapping
+  e->maps++;
+  e->used = *min_size;
+  return e->base;
+}
+
+static void tlsf_unmap_base(void* p, size_t s, void* user) {
+  (void)s;
+  extend_user_t* e = (extend_user_t*)user;
+  assert(p == e->base);
+  e->used = 0;
+}
+
+static size_t tlsf_extend_base(void* mem, size_t size, size_t want,
+                               void* user) {
+  extend_user_t* e = (extend_user_t*)user;
+  assert(mem == e->base);
+  assert(size == e->used);
+  if (e->used + want > e->cap)
+    return 0;
+  e->extends++;
+  e->used += want;
+  return want;
+}
+
+static void extend_test(void) {
+  extend_user_t e = {NULL, 4 * 1024 * 1024, 0, 0, 0};
+  e.base = (char*)malloc(e.cap);
+  assert(e.base);
+
+  tlsf_t t = tlsf_create(tlsf_map_once, tlsf_unmap_base, &e);
+  assert(t != NULL);
+  tlsf_extend(t, tlsf_extend_base);
+
+  // Each allocation outgrows the pool and must extend it contiguously.
+  void* p[16];
+  for (unsigned i = 0; i < 16; i++) {
+    p[i] = tlsf_malloc(t, 64 * 1024);
+    assert(p[i]);
+  }
+  assert(e.maps == 1);
+  assert(e.extends > 0);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  for (unsigned i = 0; i < 16; i++)
+    tlsf_free(t, p[i]);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  tlsf_destroy(t);
+  assert(e.used == 0);
+  free(e.base);
+}
+
+typedef struct {
+  size_t spacelen;
+  unsigned maps;
+  unsigned unmaps;
+} count_user_t;
+
+static void* tlsf_map_count(size_t* min_size, void* user) {
+  count_user_t* c = (count_user_t*)user;
+  c->maps++;
+  *min_size += c->spacelen;
+  void* p = malloc(*min_size);
+  assert(p);
+  return p;
+}
+
+static void tlsf_unmap_count(void* p, size_t s, void* user) {
+  (void)s;
+  ((count_user_t*)user)->unmaps++;
+  free(p);
+}
+
+static void standby_test(void) {
+  count_user_t c = {4096, 0, 0};
+  tlsf_t t = tlsf_create(tlsf_map_count, tlsf_unmap_count, &c);
+  assert(t != NULL);
+  tlsf_reserve(t, 2);
+
+  // Repeatedly drain and refill; only the first round may map.
+  void* p = tlsf_malloc(t, 512 * 1024);
+  assert(p);
+  const unsigned maps = c.maps;
+  for (unsigned i = 0; i < 10; i++) {
+    tlsf_free(t, p);
+    p = tlsf_malloc(t, 512 * 1024);
+    assert(p);
+  }
+  assert(c.maps == maps);
+  assert(c.unmaps == 0);
+  tlsf_free(t, p);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  // Now really give the memory back.
+  tlsf_trim(t);
+  assert(c.unmaps > 0);
+
+  tlsf_destroy(t);
+  assert(c.maps == c.unmaps);
+}
+
+typedef struct {
+  void* base[8];
+  size_t size[8];
+  unsigned n;
+} exact_user_t;
+
+static void* tlsf_map_exact(size_t* min_size, void* user) {
+  exact_user_t* e = (exact_user_t*)user;
+  // Grant an off-grid size: the pool span rounds down, unmap must not.
+  *min_size += 4096 + 7;
+  void* p = malloc(*min_size);
+  assert(p && e->n < 8);
+  e->base[e->n] = p;
+  e->size[e->n++] = *min_size;
+  return p;
+}
+
+static void tlsf_unmap_exact(void* p, size_t s, void* user) {
+  exact_user_t* e = (exact_user_t*)user;
+  for (unsigned i = 0; i < e->n; i++) {
+    if (e->base[i] == p) {
+      assert(e->size[i] == s);
+      e->base[i] = 0;
+      free(p);
+      return;
+    }
+  }
+  assert(!"unmap of unknown region");
+}
+
+// Every unmap must hand back exactly what the matching map granted.
+static void exact_unmap_test(void) {
+  exact_user_t e = {{0}, {0}, 0};
+  tlsf_t t = tlsf_create(tlsf_map_exact, tlsf_unmap_exact, &e);
+  assert(t != NULL);
+
+  // Force a second mapping and drop it again through remove_pool.
+  void* p = tlsf_malloc(t, 256 * 1024);
+  assert(p);
+  tlsf_free(t, p);
+
+  tlsf_destroy(t);
+  for (unsigned i = 0; i < e.n; i++)
+    assert(e.base[i] == 0);
+}
+
+static void defer_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  void* p[256];
+  for (unsigned i = 0; i < 256; i++) {
+    p[i] = tlsf_malloc(t, (i % 13 + 1) * 32);
+    assert(p[i]);
+  }
+
+  tlsf_defer(t, 1);
+  for (unsigned i = 0; i < 256; i++)
+    tlsf_free(t, p[i]);
+
+  tlsf_flush(t);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  // Disabling defer mode must flush any pending frees.
+  void* q = tlsf_malloc(t, 64);
+  assert(q);
+  tlsf_free(t, q);
+  tlsf_defer(t, 0);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  tlsf_destroy(t);
+}
+
+static void bulk_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  const size_t sizes[] = {8, 24, 100, 256, 4096};
+  for (unsigned i = 0; i < __arraycount(sizes); i++) {
+    void* p[128];
+    size_t n = tlsf_malloc_bulk(t, sizes[i], p, 128, TLSF_ZERO);
+    assert(n == 128);
+
+    for (unsigned j = 0; j < 128; j++) {
+      uint8_t* data = (uint8_t*)p[j];
+      assert(data[0] == 0 && data[sizes[i] - 1] == 0);
+      data[0] = 0xa5;
+    }
+
+#ifdef TLSF_DEBUG
+    tlsf_check(t);
+#endif
+
+    // Free every other block individually, the rest in bulk.
+    for (unsigned j = 0; j < 128; j += 2) {
+      tlsf_free(t, p[j]);
+      p[j] = NULL;
+    }
+    tlsf_free_bulk(t, p, 128);
+
+#ifdef TLSF_DEBUG
+    tlsf_check(t);
+#endif
+  }
+
+  /*
+   * A batch carved from a snug hole must never hand out the terminal
+   * fragment of the splits: four 300-byte blocks do not fit a
+   * 1000-byte hole, but every returned block must still hold 300.
+   */
+  void* hole = tlsf_malloc(t, 1000);
+  void* guard = tlsf_malloc(t, 64);
+  assert(hole && guard);
+  tlsf_free(t, hole);
+
+  void* q[4];
+  size_t n = tlsf_malloc_bulk(t, 300, q, 4, TLSF_ZERO);
+  assert(n == 4);
+  for (unsigned j = 0; j < 4; j++) {
+    assert(tlsf_usable_size(t, q[j]) >= 300);
+    memset(q[j], 0xa5, 300);
+  }
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  tlsf_free_bulk(t, q, 4);
+  tlsf_free(t, guard);
+  tlsf_destroy(t);
+}
+
+#ifdef TLSF_MT
+/*
+ * Single-threaded exercise of the remote-free list: the queue and its
+ * drain must behave exactly like tlsf_free, whichever thread pushed.
+ */
+static void remote_free_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  void* p[64];
+  for (unsigned i = 0; i < 64; i++) {
+    p[i] = tlsf_malloc(t, (i + 1) * 16);
+    assert(p[i]);
+  }
+
+  for (unsigned i = 0; i < 64; i++)
+    tlsf_free_remote(t, p[i]);
+
+  // The next allocation drains the queue.
+  void* q = tlsf_malloc(t, 32);
+  assert(q);
+  tlsf_free(t, q);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  tlsf_destroy(t);
+}
+#endif
+
+#ifdef TLSF_LOCK
+typedef struct {
+  tlsf_t t;
+  unsigned seed;
+  unsigned ops;
+} lock_worker_t;
+
+static void* lock_worker(void* arg) {
+  lock_worker_t* w = (lock_worker_t*)arg;
+  unsigned seed = w->seed;
+  void* p[64] = {0};
+
+  for (unsigned i = 0; i < w->ops; i++) {
+    unsigned j = (unsigned)rand_r(&seed) % 64;
+    if (p[j]) {
+      tlsf_free(w->t, p[j]);
+      p[j] = NULL;
+    } else {
+      size_t len = (size_t)rand_r(&seed) % 2000 + 1;
+      p[j] = tlsf_malloc(w->t, len);
+      assert(p[j]);
+      memset(p[j], (int)j, len < 64 ? len : 64);
+    }
+  }
+
+  for (unsigned j = 0; j < 64; j++)
+    if (p[j])
+      tlsf_free(w->t, p[j]);
+  return NULL;
+}
+
+// Four threads hammering one shared locked instance.
+static void lock_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  pthread_t threads[4];
+  lock_worker_t w[4];
+  for (unsigned i = 0; i < 4; i++) {
+    w[i] = (lock_worker_t){t, i + 1, 10000};
+    int err = pthread_create(&threads[i], NULL, lock_worker, &w[i]);
+    assert(err == 0);
+  }
+  for (unsigned i = 0; i < 4; i++) {
+    int err = pthread_join(threads[i], NULL);
+    assert(err == 0);
+  }
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  tlsf_destroy(t);
+}
+#endif
+
+typedef struct {
+  size_t   spacelen;
+  unsigned node_maps[2];
+} group_user_t;
+
+static void* group_map_node(size_t* min_size, unsigned node, void* user) {
+  group_user_t* gu = (group_user_t*)user;
+  assert(node < 2);
+  // A real consumer would mbind the region to the node here.
+  ++gu->node_maps[node];
+  *min_size += gu->spacelen;
+  void* p = malloc(*min_size);
+  assert(p);
+  return p;
+}
+
+static void group_unmap_node(void* p, size_t s, unsigned node, void* user) {
+  (void)s;
+  (void)user;
+  assert(node < 2);
+  free(p);
+}
+
+static void group_test(void) {
+  group_user_t gu = {1024 * 1024, {0, 0}};
+  tlsf_group_t g = tlsf_group_create(2, group_map_node, group_unmap_node,
+                                     &gu);
+  assert(g != NULL);
+  assert(tlsf_group_nodes(g) == 2);
+
+  tlsf_t t0 = tlsf_group_get(g, 0);
+  tlsf_t t1 = tlsf_group_get(g, 1);
+  assert(t0 && t1 && t0 != t1);
+  // Each node's instance mapped its control block through its own hint.
+  assert(gu.node_maps[0] >= 2 && gu.node_maps[1] >= 1);
+
+  void* p[64];
+  for (unsigned i = 0; i < 64; i++) {
+    p[i] = tlsf_malloc(i % 2 ? t1 : t0, (i + 1) * 24);
+    assert(p[i]);
+    memset(p[i], 0x3c, 24);
+  }
+
+  // Routing by the current node must name one of the members.
+  tlsf_t local = tlsf_group_local(g);
+  assert(local == t0 || local == t1);
+  void* q = tlsf_malloc(local, 128);
+  assert(q);
+  tlsf_free(local, q);
+
+  for (unsigned i = 0; i < 64; i++)
+    tlsf_free(i % 2 ? t1 : t0, p[i]);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t0);
+  tlsf_check(t1);
+#endif
+
+  tlsf_group_destroy(g);
+}
+
+static void high_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  // High allocations carve from the top of the big block and stack
+  // downward; regular ones grow upward from the bottom.
+  char* lo1 = (char*)tlsf_malloc(t, 1000);
+  char* hi1 = (char*)tlsf_mallocx(t, 1000, TLSF_HIGH);
+  char* lo2 = (char*)tlsf_malloc(t, 1000);
+  char* hi2 = (char*)tlsf_mallocx(t, 1000, TLSF_HIGH);
+  assert(lo1 && hi1 && lo2 && hi2);
+  assert(lo1 < lo2 && lo2 < hi2 && hi2 < hi1);
+  memset(hi1, 0xa5, 1000);
+  memset(hi2, 0xa5, 1000);
+
+  // Small sizes bypass the cache so they end up high as well.
+  char* small = (char*)tlsf_mallocx(t, 64, TLSF_HIGH);
+  assert(small && small > lo2 && small < hi2);
+
+  // TLSF_ZERO combines with TLSF_HIGH.
+  char* z = (char*)tlsf_mallocx(t, 600, TLSF_ZERO | TLSF_HIGH);
+  assert(z);
+  for (unsigned i = 0; i < 600; i++)
+    assert(!z[i]);
+
+  /*
+   * The segregation pays off in coalescing: churn transient blocks
+   * at the low end while long-lived ones sit at the top, then check
+   * the heap still holds one large extent.
+   */
+  void* scratch[64];
+  for (unsigned i = 0; i < 64; i++)
+    scratch[i] = tlsf_malloc(t, (size_t)rand() % 2000 + 1);
+  for (unsigned i = 0; i < 64; i++)
+    tlsf_free(t, scratch[i]);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  tlsf_free(t, lo1);
+  tlsf_free(t, lo2);
+  tlsf_free(t, hi1);
+  tlsf_free(t, hi2);
+  tlsf_free(t, small);
+  tlsf_free(t, z);
+  tlsf_destroy(t);
+}
+
+static void class_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  // The dominant constant sizes of the fast path's intended callers.
+  void* p64 = tlsf_malloc_class(t, tlsf_size_class(64));
+  void* p128 = tlsf_malloc_class(t, tlsf_size_class(128));
+  assert(p64 && p128);
+  assert(tlsf_usable_size(t, p64) >= 64);
+  assert(tlsf_usable_size(t, p128) >= 128);
+  memset(p64, 0x5a, 64);
+  memset(p128, 0x5a, 128);
+
+#ifdef TLSF_CACHE
+  // A freed small block comes back from the cache as an exact fit.
+  tlsf_free(t, p64);
+  assert(tlsf_malloc_class(t, tlsf_size_class(64)) == p64);
+#else
+  tlsf_free(t, p64);
+  p64 = tlsf_malloc_class(t, tlsf_size_class(64));
+  assert(p64);
+#endif
+
+  // The class path must grant exactly what the general path would.
+  for (size_t size = 1; size < 20000; size += 173) {
+    void* a = tlsf_malloc_class(t, tlsf_size_class(size));
+    void* b = tlsf_malloc(t, size);
+    assert(a && b);
+    assert(tlsf_usable_size(t, a) == tlsf_usable_size(t, b));
+    memset(a, 0x5a, size);
+    tlsf_free(t, a);
+    tlsf_free(t, b);
+  }
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  tlsf_free(t, p64);
+  tlsf_free(t, p128);
+  tlsf_destroy(t);
+}
+
+static void check_step_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  // A bounded step must make progress even while the heap churns.
+  void* p[256] = {0};
+  int sweeps = 0;
+  for (unsigned i = 0; i < 20000; i++) {
+    unsigned slot = (unsigned)rand() % 256;
+    if (p[slot])
+      tlsf_free(t, p[slot]);
+    p[slot] = tlsf_malloc(t, (size_t)rand() % 5000 + 1);
+    assert(p[slot]);
+
+    int rc = tlsf_check_step(t, 8);
+    assert(rc >= 0);
+    sweeps += rc;
+  }
+  assert(sweeps > 0);
+
+  // On a quiescent heap a big enough budget completes in one call.
+  assert(tlsf_check_step(t, (size_t)-1) == 1);
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  for (unsigned i = 0; i < 256; i++)
+    tlsf_free(t, p[i]);
+  tlsf_destroy(t);
+}
+
+static void bestfit_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+  tlsf_bestfit(t, 8);
+
+  /*
+   * Two free blocks of 2944 and 2976 bytes share one size class
+   * (64-byte granularity at this size); the guards prevent their
+   * coalescing. The head-of-list pick would take the 2976 one freed
+   * last, the best-fit scan must take the exact 2944 fit.
+   */
+  void* a = tlsf_malloc(t, 2944);
+  void* g1 = tlsf_malloc(t, 64);
+  void* b = tlsf_malloc(t, 2976);
+  void* g2 = tlsf_malloc(t, 64);
+  assert(a && g1 && b && g2);
+  assert(tlsf_usable_size(t, a) == 2944);
+  assert(tlsf_usable_size(t, b) == 2976);
+  tlsf_free(t, a);
+  tlsf_free(t, b);
+
+  void* p = tlsf_malloc(t, 2944);
+  assert(p == a);
+  assert(tlsf_usable_size(t, p) == 2944);
+  tlsf_free(t, p);
+
+  // The policy must stay transparent under general churn.
+  void* q[128];
+  for (unsigned i = 0; i < 128; i++) {
+    q[i] = tlsf_malloc(t, (size_t)rand() % 4000 + 1);
+    assert(q[i]);
+  }
+  for (unsigned i = 0; i < 128; i += 2)
+    tlsf_free(t, q[i]);
+  for (unsigned i = 0; i < 128; i += 2) {
+    q[i] = tlsf_malloc(t, (size_t)rand() % 2000 + 1);
+    assert(q[i]);
+  }
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t);
+#endif
+
+  for (unsigned i = 0; i < 128; i++)
+    tlsf_free(t, q[i]);
+  tlsf_free(t, g1);
+  tlsf_free(t, g2);
+  tlsf_destroy(t);
+}
+
+#define IMAGE_MAGIC 0xfeedfacecafebeefULL
+
+typedef struct {
+  unsigned live;
+  void*    ptr[256];
+} restore_walk_t;
+
+static void restore_walker(void* mem, size_t size, int kind, void* user) {
+  restore_walk_t* w = (restore_walk_t*)user;
+  if (kind != TLSF_WALK_USED)
+    return;
+
+  uint64_t magic;
+  size_t len;
+  memcpy(&magic, mem, sizeof (magic));
+  memcpy(&len, (char*)mem + 8, sizeof (len));
+  if (magic != IMAGE_MAGIC)
+    return;
+
+  // The payload must have survived the round trip byte for byte.
+  assert(len >= 16 && len <= size);
+  const unsigned char fill = (unsigned char)(len & 0xff);
+  const unsigned char* b = (const unsigned char*)mem;
+  for (size_t i = 16; i < len; i++)
+    assert(b[i] == fill);
+
+  assert(w->live < 256);
+  w->ptr[w->live++] = mem;
+}
+
+static void save_restore_test(void) {
+  size_t spacelen = 1024 * 1024;
+  tlsf_t t = tlsf_create(tlsf_map, tlsf_unmap, &spacelen);
+  assert(t != NULL);
+
+  // A tagged object graph spread over several pools.
+  void* p[128];
+  for (unsigned i = 0; i < 128; i++) {
+    size_t len = (i % 13 + 1) * 5000;
+    p[i] = tlsf_malloc(t, len);
+    assert(p[i]);
+    const uint64_t magic = IMAGE_MAGIC;
+    memcpy(p[i], &magic, sizeof (magic));
+    memcpy((char*)p[i] + 8, &len, sizeof (len));
+    memset((char*)p[i] + 16, (int)(len & 0xff), len - 16);
+  }
+
+  // Untag a few and free them, so the image carries free blocks too.
+  for (unsigned i = 0; i < 128; i += 4) {
+    memset(p[i], 0, 16);
+    tlsf_free(t, p[i]);
+  }
+
+  int fd = open("build/test-image.bin", O_CREAT | O_TRUNC | O_RDWR, 0644);
+  assert(fd >= 0);
+  int err = tlsf_save(t, fd);
+  assert(err == 0);
+
+  for (unsigned i = 0; i < 128; i++)
+    if (i % 4)
+      tlsf_free(t, p[i]);
+  tlsf_destroy(t);
+
+  // The malloc-backed map lands elsewhere, forcing the fixup pass.
+  off_t off = lseek(fd, 0, SEEK_SET);
+  assert(off == 0);
+  tlsf_t t2 = tlsf_restore(fd, tlsf_map, tlsf_unmap, &spacelen);
+  assert(t2 != NULL);
+  close(fd);
+
+#ifdef TLSF_DEBUG
+  tlsf_check(t2);
+#endif
+
+  restore_walk_t w = {0, {0}};
+  tlsf_walk(t2, restore_walker, &w);
+  assert(w.live == 96);
+
+  // The restored heap must keep serving allocations.
+  void* q = tlsf_malloc(t2, 100000);
+  assert(q);
+  tlsf_free(t2, q);
+
+  for (unsigned i = 0; i < w.live; i++)
+    tlsf_free(t2, w.ptr[i]);
+  tlsf_destroy(t2);
+}
+
+// The tlsf_small_ specialization, see test-small.c.
+void small_geometry_test(void);
+
+// The tlsf_a32_ specialization, see test-align.c.
+void alignment_geometry_test(void);
+
 int main(void) {
   srand((unsigned int)time(0));
+  small_geometry_test();
+  alignment_geometry_test();
+  bulk_test();
+  defer_test();
+  standby_test();
+  exact_unmap_test();
+  extend_test();
+  memalign_test();
+  usable_size_test();
+  grow_test();
+  metrics_test();
+  walk_test();
+  zeromap_test();
+  create_mmap_test();
+  decommit_test();
+  free_all_test();
+  direct_test();
+#ifdef TLSF_TRACE
+  trace_test();
+#endif
+#ifdef TLSF_LOCK
+  lock_test();
+#endif
+  group_test();
+  save_restore_test();
+  bestfit_test();
+  check_step_test();
+  class_test();
+  high_test();
+#ifdef TLSF_MT
+  remote_free_test();
+#endif
   large_size_test(true);
   large_size_test(false);
   random_sizes_test();
@@ -1,3 +1,6 @@
+// For MAP_ANONYMOUS and friends under -std=c11.
+#define _DEFAULT_SOURCE
+
 #include <assert.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -5,24 +8,23 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#ifdef TLSF_MT
+#include <stdatomic.h>
+#endif
+#ifdef TLSF_LOCK
+#include <pthread.h>
+#endif
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include "tlsf.h"
 
-/*
- * log2 of number of linear subdivisions of block sizes. Larger
- * values require more memory in the control structure. Values of
- * 4 or 5 are typical.
- */
-#define SL_INDEX_COUNT_SHIFT 5
+// SL_INDEX_COUNT_SHIFT and ALIGN_SIZE_SHIFT defaults live in tlsf.h,
+// where tlsf_size_class mirrors the class mapping.
 
 // All allocation sizes and addresses are aligned.
 #define ALIGN_SIZE (1ULL << ALIGN_SIZE_SHIFT)
 
-#if __WORDSIZE == 64
-#  define ALIGN_SIZE_SHIFT 3
-#else
-#  define ALIGN_SIZE_SHIFT 2
-#endif
-
 /*
  * We support allocations of sizes up to (1 << FL_INDEX_MAX) bits.
  * However, because we linearly subdivide the second-level lists, and
@@ -45,6 +47,14 @@
 
 #define SMALL_BLOCK_SIZE (1U << FL_INDEX_SHIFT)
 
+/*
+ * Maximum number of blocks parked in each small-size cache class.
+ * Only used with TLSF_CACHE.
+ */
+#ifndef TLSF_CACHE_DEPTH
+#define TLSF_CACHE_DEPTH 16
+#endif
+
 /*
  * Since block sizes are always at least a multiple of 4, the two least
  * significant bits of the size field are used to store the block status:
@@ -54,15 +64,30 @@
 #define BLOCK_FREE_BIT      (1ULL << (__WORDSIZE - 1))
 #define BLOCK_PREV_FREE_BIT (1ULL << (__WORDSIZE - 2))
 #define BLOCK_POOL_BIT      (1ULL << (__WORDSIZE - 3))
+#define BLOCK_ZERO_BIT      (1ULL << (__WORDSIZE - 4))
+#define BLOCK_DIRECT_BIT    (1ULL << (__WORDSIZE - 5))
 #define BLOCK_BITMASK       (BLOCK_POOL_BIT | BLOCK_FREE_BIT | \
-                             BLOCK_PREV_FREE_BIT)
+                             BLOCK_PREV_FREE_BIT | BLOCK_ZERO_BIT | \
+                             BLOCK_DIRECT_BIT)
 
 /*
  * The size of the block header exposed to used blocks is the size field.
  * The prev_phys_block field is stored *inside* the previous free block.
+ *
+ * A pool pays for a word remembering the exact size of the mapping
+ * behind it (handed back to the unmap callback, which may account
+ * byte-for-byte), a word remembering its block span (see add_pool and
+ * tlsf_free_all), a word with the back link of the pool chain, the
+ * first block's prev_phys_block field (reused as the forward link of
+ * the chain, walked by tlsf_walk), the first header and the sentinel
+ * header. The chain is doubly linked so removing a pool does not scan
+ * the others. The front is padded up so the first payload lands on
+ * the alignment grid.
 */
 #define BLOCK_OVERHEAD (sizeof (size_t))
-#define POOL_OVERHEAD  (2 * BLOCK_OVERHEAD)
+#define POOL_FRONT     ((5 * BLOCK_OVERHEAD + ALIGN_SIZE - 1) & \
+                        ~(ALIGN_SIZE - 1))
+#define POOL_OVERHEAD  (POOL_FRONT + BLOCK_OVERHEAD)
 
 // User data starts directly after the size field in a used block.
 #define BLOCK_START_OFFSET (offsetof(struct block_s, header) + sizeof (size_t))
@@ -90,6 +115,23 @@
 #define ASSERT(cond, msg)
 #endif
 
+/*
+ * Optional locking for an instance shared between threads without an
+ * owner. One mutex guards every mutating entry point: splits and
+ * merges move blocks freely between size classes, and a free touches
+ * its physical neighbors, both bitmap levels and the shared counters,
+ * so finer-grained per-class locks would have to be taken in unordered
+ * groups. Scalable sharing remains per-thread instances combined with
+ * tlsf_free_remote, which stays lock-free.
+ */
+#ifdef TLSF_LOCK
+#define LOCK(t)   pthread_mutex_lock(&(t)->lock)
+#define UNLOCK(t) pthread_mutex_unlock(&(t)->lock)
+#else
+#define LOCK(t)   ((void)0)
+#define UNLOCK(t) ((void)0)
+#endif
+
 // This code has been tested on 32- and 64-bit (LP/LLP) architectures.
 static_assert(sizeof(int) == 4, "Integer must be 32 bit");
 static_assert(sizeof(size_t) * 8 == __WORDSIZE,
@@ -107,6 +149,9 @@ static_assert(BLOCK_SIZE_MAX == TLSF_MAX_SIZE + BLOCK_OVERHEAD,
 // We have to use size_t bitmaps if we want to support larger blocks.
 static_assert(FL_INDEX_COUNT <= 32, "Index too large");
 static_assert(SL_INDEX_COUNT <= 32, "Index too large");
+static_assert(FL_INDEX_MAX > FL_INDEX_SHIFT, "TLSF_MAX_SHIFT too small");
+static_assert(ALIGN_SIZE >= sizeof (void*), "ALIGN_SIZE_SHIFT too small");
+static_assert(ALIGN_SIZE_SHIFT <= 5, "ALIGN_SIZE_SHIFT too large");
 
 /*
  * Data structures and associated constants.
@@ -134,20 +179,110 @@ typedef struct block_s {
   struct block_s* prev_free;
 } *block_t;
 
+// Block sizes sit BLOCK_OVERHEAD below an alignment boundary, so each
+// payload that follows a header starts aligned; the minimum size must
+// land on that grid.
+static_assert((BLOCK_SIZE_MIN + BLOCK_OVERHEAD) % ALIGN_SIZE == 0,
+              "minimum block size misses the alignment grid");
+
+/*
+ * Per first level free-list state. Keeping the second-level bitmap
+ * word adjacent to the list heads it guards means the bitmap test in
+ * search_suitable_block and the subsequent head load fall into the
+ * same prefetchable region, instead of hitting two arrays far apart
+ * in the control structure.
+ */
+typedef struct {
+  size_t  sl_bitmap;
+  block_t blocks[SL_INDEX_COUNT];
+} tlsf_fl_t;
+
 // The TLSF control structure.
 struct tlsf_s {
-  // Bitmaps for free lists.
+  // First-level bitmap for free lists.
   size_t fl_bitmap;
-  size_t sl_bitmap[FL_INDEX_COUNT];
 
   // Empty lists point at this block to indicate they are free.
   struct block_s block_null;
 
-  // Head of free lists.
-  block_t blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+  // Second-level bitmaps and free-list heads, grouped by first level.
+  tlsf_fl_t fl[FL_INDEX_COUNT];
+
+#ifdef TLSF_MT
+  // Blocks freed by foreign threads, drained by the owner.
+  _Atomic(struct block_s*) remote;
+#endif
+
+#ifdef TLSF_LOCK
+  // Serializes the mutating entry points, see LOCK/UNLOCK.
+  pthread_mutex_t lock;
+#endif
+
+#ifdef TLSF_CACHE
+  /*
+   * Singly-linked LIFO caches for the small size classes (first level
+   * 0). Cached blocks stay marked as used, so neither the free lists
+   * nor the neighboring headers are touched on the fast path.
+   */
+  block_t cache[SL_INDEX_COUNT];
+  unsigned char cache_count[SL_INDEX_COUNT];
+#endif
+
+  // Deferred coalescing, see tlsf_defer/tlsf_flush.
+  bool    defer;
+  block_t deferred;
+
+  // Memory from the map callback is known zero, see tlsf_zeromap.
+  bool zeromap;
+
+  // Dedicated-mapping threshold, see tlsf_direct. Zero disables.
+  size_t direct;
+
+  // Best-fit scan depth, see tlsf_bestfit. Zero disables.
+  size_t bestfit;
+
+  /*
+   * Incremental checker cursor, see tlsf_check_step. The block cursor
+   * names a live free-list entry (phase 0) or physical block (phase 1);
+   * the handful of places where such a block can cease to exist nudge
+   * the cursor along so it never dangles between steps.
+   */
+  unsigned int check_phase;  // 0: free lists, 1: physical chains
+  unsigned int check_fl;
+  unsigned int check_sl;
+  block_t      check_block;  // resume point, 0 restarts the list
+  block_t      check_pool;   // current pool of the physical phase
+
+  // Chain of the first blocks of all pools, see add_pool/tlsf_walk.
+  block_t pool_head;
+
+  // Empty mapped pools parked for reuse, see tlsf_reserve/tlsf_trim.
+  block_t      standby;
+  unsigned int standby_count;
+  unsigned int standby_max;
+
+  // Most recently mapped region, the target for in-place extension.
+  tlsf_extend_t extend;
+  void*         last_base;
+  size_t        last_size;
+
+#ifdef TLSF_TRACE
+  int                 trace_fd;
+  unsigned int        trace_n;
+  tlsf_trace_event_t* trace_buf;
+#endif
+
+  // Sampled latency histograms and slow-path counters.
+  tlsf_metrics_t metrics;
+  size_t         sample_interval;
+  size_t         sample_countdown;
 
 #ifdef TLSF_STATS
   tlsf_stats_t stats;
+
+  // Per size class search outcome, see tlsf_class_stats.
+  size_t class_hits[FL_INDEX_COUNT][SL_INDEX_COUNT];
+  size_t class_misses[FL_INDEX_COUNT][SL_INDEX_COUNT];
 #endif
 
   tlsf_map_t   map;
@@ -176,6 +311,26 @@ static inline unsigned int tlsf_fls(size_t x) {
     (x ? 8 * sizeof (size_t) - (uint32_t)__builtin_clzll(x) - 1 : 0);
 }
 
+// Cycle counter for the sampled latency histograms.
+static inline uint64_t tlsf_cycles(void) {
+#if defined __x86_64__ || defined __i386__
+  return __builtin_ia32_rdtsc();
+#elif defined __aarch64__
+  uint64_t c;
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(c));
+  return c;
+#else
+  return 0;
+#endif
+}
+
+static inline void metrics_record(size_t* hist, uint64_t cycles) {
+  unsigned int b = tlsf_fls((size_t)cycles);
+  if (b >= TLSF_METRICS_BUCKETS)
+    b = TLSF_METRICS_BUCKETS - 1;
+  ++hist[b];
+}
+
 /*
  * block_t member functions.
 */
@@ -246,8 +401,10 @@ static inline void block_set_free(block_t block, bool free) {
     ASSERT(!block_is_free(block), "Block is already free");
     block->header |= BLOCK_FREE_BIT;
   } else {
+    // The user is going to write the payload, so the known-zero
+    // property dies with the allocation.
     ASSERT(block_is_free(block), "Block is already used");
-    block->header &= ~BLOCK_FREE_BIT;
+    block->header &= ~(BLOCK_FREE_BIT | BLOCK_ZERO_BIT);
   }
   block_set_prev_free(block_link_next(block), free);
 }
@@ -267,7 +424,9 @@ static inline void* align_ptr(const void* ptr) {
  * than internal minimum.
 */
 static inline size_t adjust_size(size_t size) {
-  size = align_up(size);
+  // Sizes are kept BLOCK_OVERHEAD short of a multiple of the
+  // alignment, so the payload after the next header starts aligned.
+  size = align_up(size + BLOCK_OVERHEAD) - BLOCK_OVERHEAD;
   if (size < BLOCK_SIZE_MIN)
     return BLOCK_SIZE_MIN;
   ASSERT(size <= TLSF_MAX_SIZE, "size is too large");
@@ -314,7 +473,7 @@ static block_t search_suitable_block(tlsf_t t, unsigned int *fli,
    * First, search for a block in the list associated with the given
    * fl/sl index.
    */
-  size_t sl_map = t->sl_bitmap[fl] & (~0UL << sl);
+  size_t sl_map = t->fl[fl].sl_bitmap & (~0UL << sl);
   if (!sl_map) {
     // No block exists. Search in the next largest first-level list.
     const size_t fl_map = t->fl_bitmap & (~0UL << (fl + 1));
@@ -322,18 +481,22 @@ static block_t search_suitable_block(tlsf_t t, unsigned int *fli,
     if (!fl_map)
       return 0;
 
+    ++t->metrics.search_escalations;
     *fli = fl = tlsf_ffs(fl_map);
     ASSERT(fl < FL_INDEX_COUNT, "Wrong fl index count");
 
-    sl_map = t->sl_bitmap[fl];
+    sl_map = t->fl[fl].sl_bitmap;
   }
   ASSERT(sl_map, "Second level bitmap is null");
 
   *sli = sl = tlsf_ffs(sl_map);
   ASSERT(sl < SL_INDEX_COUNT, "Wrong sl index count");
 
-  // Return the first block in the free list.
-  return t->blocks[fl][sl];
+  // Return the first block in the free list. Prefetch its header so
+  // the free-list unlink that follows hits a warm line.
+  block_t block = t->fl[fl].blocks[sl];
+  __builtin_prefetch(block);
+  return block;
 }
 
 // Remove a free block from the free list.
@@ -346,19 +509,24 @@ static void remove_free_block(tlsf_t t, block_t block, unsigned int fl,
   const block_t next = block->next_free;
   ASSERT(prev, "prev_free field can not be null");
   ASSERT(next, "next_free field can not be null");
+
+  // Keep the incremental checker's list cursor off the departing block.
+  if (block == t->check_block && !t->check_phase)
+    t->check_block = next;
+
   next->prev_free = prev;
   prev->next_free = next;
 
   // If this block is the head of the free list, set new head.
-  if (t->blocks[fl][sl] == block) {
-    t->blocks[fl][sl] = next;
+  if (t->fl[fl].blocks[sl] == block) {
+    t->fl[fl].blocks[sl] = next;
 
     // If the new head is null, clear the bitmap.
     if (next == &t->block_null) {
-      t->sl_bitmap[fl] &= ~(1U << sl);
+      t->fl[fl].sl_bitmap &= ~(1U << sl);
 
       // If the second bitmap is now empty, clear the fl bitmap.
-      if (!t->sl_bitmap[fl])
+      if (!t->fl[fl].sl_bitmap)
         t->fl_bitmap &= ~(1U << fl);
     }
   }
@@ -373,7 +541,7 @@ static void remove_free_block(tlsf_t t, block_t block, unsigned int fl,
 // Insert a free block into the free block list.
 static void insert_free_block(tlsf_t t, block_t block, unsigned int fl,
                               unsigned int sl) {
-  const block_t current = t->blocks[fl][sl];
+  const block_t current = t->fl[fl].blocks[sl];
   ASSERT(current, "free list cannot have a null entry");
   ASSERT(block, "cannot insert a null entry into the free list");
   block->next_free = current;
@@ -386,9 +554,9 @@ static void insert_free_block(tlsf_t t, block_t block, unsigned int fl,
    * Insert the new block at the head of the list, and mark the first-
    * and second-level bitmaps appropriately.
   */
-  t->blocks[fl][sl] = block;
+  t->fl[fl].blocks[sl] = block;
   t->fl_bitmap |= (1U << fl);
-  t->sl_bitmap[fl] |= (1U << sl);
+  t->fl[fl].sl_bitmap |= (1U << sl);
 
 #ifdef TLSF_STATS
   ASSERT(t->stats.used_size >= block_size(block), "wrong used");
@@ -425,7 +593,8 @@ static block_t block_split(block_t block, size_t size) {
          "remaining block size is wrong");
   ASSERT(remain_size >= BLOCK_SIZE_MIN, "block split with invalid size");
 
-  remaining->header = remain_size;
+  // Both halves of a known-zero block stay known zero.
+  remaining->header = remain_size | (block->header & BLOCK_ZERO_BIT);
 
   block_set_free(remaining, true);
   block_set_size(block, size);
@@ -436,8 +605,10 @@ static block_t block_split(block_t block, size_t size) {
 // Absorb a free block's storage into an adjacent previous free block.
 static block_t block_absorb(block_t prev, block_t block) {
   ASSERT(!block_is_last(prev), "previous block can't be last");
-  // Note: Leaves flags untouched.
+  // Note: Leaves flags untouched. The absorbed header word dirties the
+  // payload, so the result is no longer known zero.
   prev->header += block_size(block) + BLOCK_OVERHEAD;
+  prev->header &= ~BLOCK_ZERO_BIT;
   block_link_next(prev);
   return prev;
 }
@@ -449,6 +620,8 @@ static block_t block_merge_prev(tlsf_t t, block_t block) {
     ASSERT(prev, "prev physical block can't be null");
     ASSERT(block_is_free(prev), "prev block is not free though marked as such");
     block_remove(t, prev);
+    if (block == t->check_block && t->check_phase)
+      t->check_block = prev;
     block = block_absorb(prev, block);
   }
 
@@ -463,12 +636,29 @@ static block_t block_merge_next(tlsf_t t, block_t block) {
   if (block_is_free(next)) {
     ASSERT(!block_is_last(block), "previous block can't be last");
     block_remove(t, next);
+    if (next == t->check_block && t->check_phase)
+      t->check_block = block;
     block = block_absorb(block, next);
   }
 
   return block;
 }
 
+/*
+ * Zero the user-visible part of a just-allocated block. A known-zero
+ * block was carved from a freshly mapped region, so only the words the
+ * free-list bookkeeping dirtied need clearing: the two link fields at
+ * the front and the prev_phys_block scribble at the back.
+ */
+static inline void block_zero(bool known_zero, void* p, size_t size) {
+  if (known_zero) {
+    memset(p, 0, 2 * sizeof (size_t));
+    memset((char*)p + size - sizeof (size_t), 0, sizeof (size_t));
+  } else {
+    memset(p, 0, size);
+  }
+}
+
 // Trim any trailing block space off the end of a block, return to pool.
 static void block_trim_free(tlsf_t t, block_t block, size_t size) {
   ASSERT(block_is_free(block), "block must be free");
@@ -493,27 +683,134 @@ static void block_trim_used(tlsf_t t, block_t block, size_t size) {
   }
 }
 
+/*
+ * Trim leading block space off the front of a block instead, leaving
+ * the allocation at its high-address end (TLSF_HIGH).
+ */
+static block_t block_trim_free_high(tlsf_t t, block_t block, size_t size) {
+  ASSERT(block_is_free(block), "block must be free");
+  if (block_can_split(block, size)) {
+    block_t remaining = block_split(block, block_size(block) - size
+                                    - BLOCK_OVERHEAD);
+    block_link_next(block);
+    block_set_prev_free(remaining, true);
+    block_insert(t, block);
+    block = remaining;
+  }
+  return block;
+}
+
 // Locate a free block with an appropriate size.
 static block_t block_locate_free(tlsf_t t, size_t size) {
   unsigned int fl = 0, sl = 0;
+
+  if (t->bestfit) {
+    /*
+     * Scan the exact class for the tightest fit before escalating.
+     * Unlike the rounded search below, blocks in this list are not
+     * guaranteed to fit, so every candidate is checked; the scan is
+     * bounded so a long list cannot stall the allocation.
+     */
+    mapping_insert(size, &fl, &sl);
+    block_t best = 0;
+    size_t best_size = 0;
+    size_t depth = t->bestfit;
+    for (block_t block = t->fl[fl].blocks[sl];
+         block != &t->block_null && depth--; block = block->next_free) {
+      const size_t bsize = block_size(block);
+      if (bsize < size)
+        continue;
+      if (!best || bsize < best_size) {
+        best = block;
+        best_size = bsize;
+        if (bsize == size)
+          break;
+      }
+    }
+    if (best) {
+#ifdef TLSF_STATS
+      ++t->class_hits[fl][sl];
+#endif
+      remove_free_block(t, best, fl, sl);
+      return best;
+    }
+  }
+
   mapping_insert(round_block_size(size), &fl, &sl);
 
+#ifdef TLSF_STATS
+  const unsigned int wfl = fl, wsl = sl;
+#endif
+
   block_t block = search_suitable_block(t, &fl, &sl);
   if (block) {
     ASSERT(block_size(block) >= size, "insufficient block size");
+
+#ifdef TLSF_STATS
+    // An exact class fit, or an escalation to a larger class which
+    // costs a split and leaves a fragment behind.
+    if (fl == wfl && sl == wsl)
+      ++t->class_hits[wfl][wsl];
+    else
+      ++t->class_misses[wfl][wsl];
+#endif
+
     remove_free_block(t, block, fl, sl);
   }
   return block;
 }
 
+/*
+ * Locate the head of the topmost occupied class, the home of the
+ * largest free blocks, so a TLSF_HIGH allocation is carved out of a
+ * large extent rather than a snug hole.
+ */
+static block_t block_locate_free_high(tlsf_t t, size_t size) {
+  if (t->fl_bitmap) {
+    const unsigned int fl = tlsf_fls(t->fl_bitmap);
+    const unsigned int sl = tlsf_fls(t->fl[fl].sl_bitmap);
+    block_t block = t->fl[fl].blocks[sl];
+    if (block_size(block) >= size) {
+      remove_free_block(t, block, fl, sl);
+      return block;
+    }
+  }
+  // Even the largest block is too small; take whatever fits.
+  return block_locate_free(t, size);
+}
+
+// Dispatch on the end of the block the allocation is carved from.
+static block_t block_locate(tlsf_t t, size_t size, int flags) {
+  return flags & TLSF_HIGH
+    ? block_locate_free_high(t, size) : block_locate_free(t, size);
+}
+
 /*
  * Overhead of the TLSF structures in a given memory block passed to
  * add_pool, equal to the overhead of a free block and the
  * sentinel block.
 */
 
+// Back link of the doubly linked pool chain, in the pool front.
+static inline block_t* pool_prev_link(block_t block) {
+  return (block_t*)((char*)block - 2 * BLOCK_OVERHEAD);
+}
+
+/*
+ * Exact size of the mapping behind the pool, measured from the pool
+ * base, in the pool front. The block span is rounded down to the
+ * alignment grid (and capped at BLOCK_SIZE_MAX), so it can come up
+ * short of what the map callback granted; unmap gets this word back
+ * instead.
+ */
+static inline size_t* pool_mapped_size(block_t block) {
+  return (size_t*)((char*)block - 3 * BLOCK_OVERHEAD);
+}
+
 static block_t add_pool(tlsf_t t, void* mem, size_t size) {
-  size_t pool_size = size - POOL_OVERHEAD;
+  // Round the span down to the alignment grid of block sizes.
+  size_t pool_size = ((size - POOL_OVERHEAD + BLOCK_OVERHEAD)
+                      & ~(ALIGN_SIZE - 1)) - BLOCK_OVERHEAD;
   if (pool_size > BLOCK_SIZE_MAX)
     pool_size = BLOCK_SIZE_MAX; // Allow larger pool sizes returned by tlsf_map
 
@@ -527,12 +824,22 @@ static block_t add_pool(tlsf_t t, void* mem, size_t size) {
 #endif
 
   /*
-   * Create the main free block. Offset the start of the block slightly
-   * so that the prev_phys_block field falls outside of the pool -
-   * it will never be used.
+   * Create the main free block. The first word of the pool remembers
+   * the block span so tlsf_free_all can rebuild the pool without
+   * walking it. The prev_phys_block field of a first block can never
+   * hold a physical neighbor - there is none - so it stores the link
+   * of the pool chain walked by tlsf_walk instead.
    */
-  block_t block = OFFSET_TO_BLOCK(mem, -BLOCK_OVERHEAD);
-  block->header = pool_size | BLOCK_FREE_BIT;
+  block_t block = OFFSET_TO_BLOCK(mem, POOL_FRONT - BLOCK_START_OFFSET);
+  *(size_t*)((char*)block - BLOCK_OVERHEAD) = pool_size;
+  *pool_mapped_size(block) = size;
+  block->header = pool_size | BLOCK_FREE_BIT
+    | (t->zeromap ? BLOCK_ZERO_BIT : 0);
+  *pool_prev_link(block) = 0;
+  if (t->pool_head)
+    *pool_prev_link(t->pool_head) = block;
+  block->prev_phys_block = t->pool_head;
+  t->pool_head = block;
   block_insert(t, block);
 
   // Split the block to create a zero-size sentinel block.
@@ -556,168 +863,1186 @@ static void remove_pool(tlsf_t t, block_t block) {
   ASSERT(block_is_last(block_next(block)), "sentinel should be last");
   ASSERT(!block_is_free(block_next(block)),
          "sentinel block should not be free");
-  t->unmap((char*)block + BLOCK_OVERHEAD, size + POOL_OVERHEAD, t->user);
-}
 
-/*
- * TLSF main interface.
-*/
+  // The incremental checker cannot follow the pool out of the chain.
+  if (t->check_phase) {
+    if (block == t->check_pool)
+      t->check_pool = block->prev_phys_block;
+    char* base = (char*)block_to_ptr(block) - POOL_FRONT;
+    if ((size_t)((char*)t->check_block - base) < size + POOL_OVERHEAD)
+      t->check_block = 0;
+  }
 
-tlsf_t tlsf_create(tlsf_map_t map, tlsf_unmap_t unmap, void* user) {
-  ASSERT(map, "map must not be null");
-  const size_t minsize = TLSF_SIZE + POOL_OVERHEAD + BLOCK_SIZE_MIN;
-  size_t size = minsize;
-  void* mem = map(&size, user);
-  ASSERT(mem, "no memory available");
-  ASSERT(size >= minsize, "not enough memory allocated");
-  ASSERT((size_t)mem % ALIGN_SIZE == 0, "wrong alignment");
+  // Unlink the pool from the doubly linked pool chain.
+  block_t next = block->prev_phys_block;
+  block_t prev = *pool_prev_link(block);
+  if (prev)
+    prev->prev_phys_block = next;
+  else
+    t->pool_head = next;
+  if (next)
+    *pool_prev_link(next) = prev;
+
+  // The region is gone either way; stop extending into it.
+  if ((char*)block_to_ptr(block) - POOL_FRONT == (char*)t->last_base)
+    t->last_base = 0;
+
+  // Park the pool on the standby list instead of unmapping it.
+  if (t->standby_count < t->standby_max) {
+    block->next_free = t->standby;
+    t->standby = block;
+    ++t->standby_count;
+    return;
+  }
 
-  tlsf_t t = (tlsf_t)mem;
-  t->map = map;
-  t->unmap = unmap;
-  t->user = user;
+  t->unmap((char*)block_to_ptr(block) - POOL_FRONT, *pool_mapped_size(block),
+           t->user);
+}
+
+/*
+ * Reinstate a parked pool whose free block can satisfy a request of the
+ * given (rounded) size, so load transitions do not oscillate between
+ * the map and unmap callbacks.
+ */
+static bool revive_pool(tlsf_t t, size_t size) {
+  block_t* prev = &t->standby;
+  for (block_t block = *prev; block; prev = &block->next_free, block = *prev) {
+    if (block_size(block) >= size) {
+      *prev = block->next_free;
+      --t->standby_count;
 
 #ifdef TLSF_STATS
-  memset(&t->stats, 0, sizeof (t->stats));
+      ++t->stats.pool_count;
+      t->stats.total_size += block_size(block);
+      t->stats.used_size += block_size(block);
 #endif
 
-  t->block_null.next_free = &t->block_null;
-  t->block_null.prev_free = &t->block_null;
-
-  t->fl_bitmap = 0;
-  for (unsigned int i = 0; i < FL_INDEX_COUNT; ++i) {
-    t->sl_bitmap[i] = 0;
-    for (unsigned int j = 0; j < SL_INDEX_COUNT; ++j)
-      t->blocks[i][j] = &t->block_null;
+      *pool_prev_link(block) = 0;
+      if (t->pool_head)
+        *pool_prev_link(t->pool_head) = block;
+      block->prev_phys_block = t->pool_head;
+      t->pool_head = block;
+      block_insert(t, block);
+      return true;
+    }
   }
+  return false;
+}
 
-  add_pool(t, (char*)mem + TLSF_SIZE, size - TLSF_SIZE);
+// Mark a block free, coalesce it and return it to the free lists.
+static void block_free(tlsf_t t, block_t block) {
+  block_set_free(block, true);
+  block = block_merge_prev(t, block);
+  block = block_merge_next(t, block);
 
-  return t;
+  if ((block->header & BLOCK_POOL_BIT) &&
+      block_is_last(block_next(block)) &&
+      t->unmap)
+    remove_pool(t, block);
+  else
+    block_insert(t, block);
 }
 
-void tlsf_destroy(tlsf_t t) {
+/*
+ * Grow the most recent pool in place so that it can satisfy a request
+ * of the given (rounded) size. The old zero-size sentinel becomes a
+ * free block covering the extension and merges with a free block at
+ * the end of the pool, so pool boundaries no longer block coalescing.
+ */
+// Entry-point internals, defined with the public interface below.
+static void* do_mallocx(tlsf_t t, size_t size, int flags);
+static void do_free(tlsf_t t, void* mem);
+static void do_flush(tlsf_t t);
+
+static bool try_extend(tlsf_t t, size_t size) {
+  if (!t->extend || !t->last_base)
+    return false;
+
+  const size_t want = size + BLOCK_OVERHEAD + ALIGN_SIZE - 1;
+  const size_t delta = t->extend(t->last_base, t->last_size, want, t->user);
+  if (!delta)
+    return false;
+  ASSERT(delta >= want, "not enough memory allocated");
+
+  /*
+   * The pool grid ends at the aligned-down mapping size; an off-grid
+   * remainder is carried in last_size and recovered once a later
+   * extension completes the alignment unit.
+   */
+  const size_t end = t->last_size & ~(ALIGN_SIZE - 1);
+  block_t sent = OFFSET_TO_BLOCK(t->last_base, end - 2 * BLOCK_OVERHEAD);
+  ASSERT(block_is_last(sent), "sentinel should be last");
+
+  t->last_size += delta;
+  const size_t usable = (t->last_size & ~(ALIGN_SIZE - 1)) - end;
+
+  // Keep the span and mapped-size words at the pool base in sync, for
+  // tlsf_free_all and the unmap callback respectively. The pool
+  // created by tlsf_create sits behind the control structure.
+  block_t pool = OFFSET_TO_BLOCK(t->last_base == (void*)t
+                                 ? (char*)align_up((size_t)t + TLSF_SIZE)
+                                 : (char*)t->last_base,
+                                 POOL_FRONT - BLOCK_START_OFFSET);
+  *(size_t*)((char*)pool - BLOCK_OVERHEAD) += usable;
+  *pool_mapped_size(pool) += delta;
+
+  // The old sentinel heads the extension; a new sentinel ends it.
+  sent->header = (usable - BLOCK_OVERHEAD)
+    | (sent->header & BLOCK_PREV_FREE_BIT);
+  block_link_next(sent)->header = 0;
+
 #ifdef TLSF_STATS
-  ASSERT(t->stats.free_size == t->stats.total_size, "Memory leak detected.");
-  ASSERT((t->unmap && t->stats.pool_count == 1) ||
-         (!t->unmap && t->stats.pool_count >= 1),
-        "Memory leak detected. Some pools were not released.");
+  size_t gain = usable - BLOCK_OVERHEAD;
+  // A merge with a free block at the pool end recycles the old
+  // sentinel header as well.
+  if (block_is_prev_free(sent))
+    gain += BLOCK_OVERHEAD;
+  t->stats.total_size += gain;
+  t->stats.used_size += gain;
 #endif
 
-  if (t->unmap) {
-    block_t first_block = OFFSET_TO_BLOCK(t, TLSF_SIZE  - BLOCK_OVERHEAD);
-    ASSERT(block_is_last(block_next(first_block)), "sentinel should be last");
-    ASSERT(!block_is_free(block_next(first_block)),
-           "sentinel block should not be free");
-    t->unmap(t, TLSF_SIZE + block_size(first_block) + POOL_OVERHEAD, t->user);
-  }
+  block_free(t, sent);
+  return true;
 }
 
-void* tlsf_mallocx(tlsf_t t, size_t size, int flags) {
-  ASSERT((flags & ~(TLSF_ZERO | TLSF_NOMAP)) == 0, "Invalid flags");
+#ifdef TLSF_TRACE
+// Number of buffered events between flushes to the trace file.
+#ifndef TLSF_TRACE_EVENTS
+#define TLSF_TRACE_EVENTS 1024
+#endif
 
-  size = adjust_size(size);
+static void trace_flush(tlsf_t t) {
+  if (t->trace_n) {
+    ssize_t n = write(t->trace_fd, t->trace_buf,
+                      t->trace_n * sizeof (tlsf_trace_event_t));
+    (void)n;
+    t->trace_n = 0;
+  }
+}
+
+// Append one fixed-size event to the trace ring.
+static inline void trace_event(tlsf_t t, unsigned int op, const void* ptr,
+                               const void* ptr2, size_t size) {
+  if (t->trace_fd < 0)
+    return;
+  tlsf_trace_event_t* e = &t->trace_buf[t->trace_n++];
+  e->size_op = size | ((size_t)op << (__WORDSIZE - 8));
+  e->ptr = (size_t)ptr;
+  e->ptr2 = (size_t)ptr2;
+  if (t->trace_n == TLSF_TRACE_EVENTS)
+    trace_flush(t);
+}
+#else
+#define trace_event(t, op, ptr, ptr2, size)
+#endif
 
-  block_t block = block_locate_free(t, size);
+/*
+ * Locate a free block for the given adjusted size, falling back to the
+ * pending-free list, the standby pools, in-place extension and finally
+ * the map callback. The returned block is removed from the free lists
+ * but still marked free.
+ */
+static block_t block_acquire(tlsf_t t, size_t size, int flags) {
+  block_t block = block_locate(t, size, flags);
+  if (!block && t->deferred) {
+    // Coalescing the postponed frees may satisfy the request.
+    do_flush(t);
+    block = block_locate(t, size, flags);
+  }
+  if (!block && revive_pool(t, round_block_size(size)))
+    block = block_locate(t, size, flags);
   if (!block) {
     if (flags & TLSF_NOMAP)
       return 0;
-    size_t minsize = POOL_OVERHEAD + BLOCK_OVERHEAD + round_block_size(size);
-    size_t memsize = minsize;
-    void* mem = t->map(&memsize, t->user);
-    if (!mem)
-      return 0;
-    ASSERT(memsize >= minsize, "not enough memory allocated");
-    add_pool(t, (char*)mem, memsize)->header |= BLOCK_POOL_BIT;
-    block = block_locate_free(t, size);
+    if (!try_extend(t, round_block_size(size))) {
+      size_t minsize = POOL_OVERHEAD + ALIGN_SIZE + round_block_size(size);
+      size_t memsize = minsize;
+      ++t->metrics.map_calls;
+      void* mem = t->map(&memsize, t->user);
+      if (!mem)
+        return 0;
+      ASSERT(memsize >= minsize, "not enough memory allocated");
+      block_t pool = add_pool(t, (char*)mem, memsize);
+      pool->header |= BLOCK_POOL_BIT;
+      t->last_base = memsize - POOL_OVERHEAD > BLOCK_SIZE_MAX ? 0 : mem;
+      t->last_size = block_size(pool) + POOL_OVERHEAD;
+    }
+    block = block_locate(t, size, flags);
+    ASSERT(block, "No block found");
   }
-  ASSERT(block, "No block found");
+  return block;
+}
 
-#ifdef TLSF_STATS
-  ++t->stats.malloc_count;
-#endif
+void tlsf_defer(tlsf_t t, int defer) {
+  LOCK(t);
+  t->defer = !!defer;
+  if (!t->defer)
+    do_flush(t);
+  UNLOCK(t);
+}
 
-  block_trim_free(t, block, size);
-  block_set_free(block, false);
+// Coalesce all frees postponed by the defer mode.
+static void do_flush(tlsf_t t) {
+  block_t block = t->deferred;
+  t->deferred = 0;
+  while (block) {
+    block_t next = block->next_free;
+    block_free(t, block);
+    block = next;
+  }
+}
 
-  void* p = block_to_ptr(block);
-  if (flags & TLSF_ZERO)
-    memset(p, 0, size);
-  return p;
+void tlsf_flush(tlsf_t t) {
+  LOCK(t);
+  do_flush(t);
+  UNLOCK(t);
 }
 
-void tlsf_free(tlsf_t t, void* mem) {
-  if (!mem) // to support free after zero size realloc
-    return;
+void tlsf_extend(tlsf_t t, tlsf_extend_t extend) {
+  t->extend = extend;
+}
 
-  block_t block = block_from_ptr(mem);
-  ASSERT(!block_is_free(block), "block already marked as free");
+void tlsf_zeromap(tlsf_t t, int zeromap) {
+  t->zeromap = !!zeromap;
+}
 
-#ifdef TLSF_STATS
-  ++t->stats.free_count;
-#endif
+void tlsf_direct(tlsf_t t, size_t threshold) {
+  t->direct = threshold;
+}
 
-  block_set_free(block, true);
-  block = block_merge_prev(t, block);
-  block = block_merge_next(t, block);
+void tlsf_bestfit(tlsf_t t, size_t depth) {
+  t->bestfit = depth;
+}
 
-  if ((block->header & BLOCK_POOL_BIT) &&
-      block_is_last(block_next(block)) &&
-      t->unmap)
-    remove_pool(t, block);
-  else
-    block_insert(t, block);
+void tlsf_reserve(tlsf_t t, unsigned int pools) {
+  LOCK(t);
+  t->standby_max = pools;
+  while (t->standby_count > t->standby_max) {
+    block_t block = t->standby;
+    t->standby = block->next_free;
+    --t->standby_count;
+    t->unmap((char*)block_to_ptr(block) - POOL_FRONT,
+             *pool_mapped_size(block), t->user);
+  }
+  UNLOCK(t);
 }
 
 /*
- * The TLSF block information provides us with enough information to
- * provide a reasonably intelligent implementation of realloc, growing or
- * shrinking the currently allocated block as required.
- *
- * This routine handles the somewhat esoteric edge cases of realloc:
- * - a non-zero size with a null pointer will behave like malloc
- * - a zero size with a non-null pointer will behave like free
- * - a request that cannot be satisfied will leave the original buffer
- *   untouched
- * - an extended buffer size will leave the newly-allocated area with
- *   contents undefined
+ * Return the page-aligned interior of large free blocks to the kernel
+ * with MADV_DONTNEED, walking the free lists from the largest class
+ * down until only keep bytes of free payload are left committed. The
+ * blocks stay linked in the free lists - the headers, the list links
+ * and the neighbor's prev_phys_block word remain resident - so the
+ * first touch after reallocation just faults zero pages back in.
  */
-void* tlsf_reallocx(tlsf_t t, void* mem, size_t size, int flags) {
-  ASSERT((flags & ~(TLSF_ZERO | TLSF_NOMAP | TLSF_INPLACE)) == 0,
-         "Invalid flags");
+size_t tlsf_decommit(tlsf_t t, size_t keep) {
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t done = 0;
 
-  // Zero-size requests are treated as free.
-  if (mem && size == 0) {
-    tlsf_free(t, mem);
-    return 0;
+  LOCK(t);
+
+  for (unsigned int fl = FL_INDEX_COUNT; fl-- > 0;) {
+    if (!(t->fl_bitmap & (1ULL << fl)))
+      continue;
+    for (unsigned int sl = SL_INDEX_COUNT; sl-- > 0;) {
+      if (!(t->fl[fl].sl_bitmap & (1ULL << sl)))
+        continue;
+      for (block_t block = t->fl[fl].blocks[sl]; block != &t->block_null;
+           block = block->next_free) {
+        const size_t size = block_size(block);
+        if (keep) {
+          keep -= size < keep ? size : keep;
+          continue;
+        }
+
+        // Keep the free-list links at the front and the
+        // prev_phys_block scribble at the back resident.
+        const size_t lo = ((size_t)block_to_ptr(block)
+                           + 2 * sizeof (size_t) + page - 1) & ~(page - 1);
+        const size_t hi = ((size_t)block_to_ptr(block) + size
+                           - sizeof (size_t)) & ~(page - 1);
+        if (hi > lo && madvise((void*)lo, hi - lo, MADV_DONTNEED) == 0)
+          done += hi - lo;
+      }
+    }
   }
+  UNLOCK(t);
+  return done;
+}
 
-  // Requests with NULL pointers are treated as malloc.
-  if (!mem)
-    return tlsf_mallocx(t, size, flags & (TLSF_ZERO | TLSF_NOMAP));
+// Release all parked pools through the unmap callback.
+void tlsf_trim(tlsf_t t) {
+  LOCK(t);
+  block_t block = t->standby;
+  t->standby = 0;
+  t->standby_count = 0;
+  while (block) {
+    block_t next = block->next_free;
+    t->unmap((char*)block_to_ptr(block) - POOL_FRONT,
+             *pool_mapped_size(block), t->user);
+    block = next;
+  }
+  UNLOCK(t);
+}
 
-  block_t block = block_from_ptr(mem);
-  block_t next = block_next(block);
+/*
+ * Abandon every live allocation and rebuild each retained pool as one
+ * maximal free block, exactly as if its memory had just come back from
+ * the map callback. Costs O(pools) rather than O(allocations), so an
+ * instance can serve as a request-scoped arena without paying for a
+ * destroy/create cycle between requests.
+ */
+void tlsf_free_all(tlsf_t t) {
+  LOCK(t);
 
-  const size_t cursize = block_size(block);
-  const size_t combined = cursize + block_size(next) + BLOCK_OVERHEAD;
-  size = adjust_size(size);
+#ifdef TLSF_MT
+  // Remote frees only name blocks the rebuild reclaims wholesale.
+  atomic_store_explicit(&t->remote, 0, memory_order_relaxed);
+#endif
 
-  ASSERT(!block_is_free(block), "block already marked as free");
+#ifdef TLSF_CACHE
+  for (unsigned int i = 0; i < SL_INDEX_COUNT; ++i) {
+    t->cache[i] = 0;
+    t->cache_count[i] = 0;
+  }
+#endif
 
-  /*
-   * If the next block is used, or when combined with the current
-   * block, does not offer enough space, we must reallocate and copy.
-   */
-  if (size > cursize && (!block_is_free(next) || size > combined)) {
-    if (flags & TLSF_INPLACE)
-      return 0;
-    char* p = (char*)tlsf_mallocx(t, size, flags & (TLSF_NOMAP | TLSF_NOMAP));
-    if (p) {
-      memcpy(p, mem, cursize);
+  t->deferred = 0;
+
+  // Every block the checker could be parked on is about to vanish.
+  t->check_phase = 0;
+  t->check_fl = 0;
+  t->check_sl = 0;
+  t->check_block = 0;
+  t->check_pool = 0;
+
+  // Clear only the classes the bitmaps mark as occupied.
+  while (t->fl_bitmap) {
+    const unsigned int fl = tlsf_ffs(t->fl_bitmap);
+    while (t->fl[fl].sl_bitmap) {
+      const unsigned int sl = tlsf_ffs(t->fl[fl].sl_bitmap);
+      t->fl[fl].blocks[sl] = &t->block_null;
+      t->fl[fl].sl_bitmap &= ~(1U << sl);
+    }
+    t->fl_bitmap &= ~(1U << fl);
+  }
+
+#ifdef TLSF_STATS
+  t->stats.free_size = 0;
+  t->stats.used_size = t->stats.total_size;
+#endif
+
+  for (block_t block = t->pool_head; block; block = block->prev_phys_block) {
+    const size_t span = *(size_t*)((char*)block - BLOCK_OVERHEAD);
+    block->header = span | BLOCK_FREE_BIT | (block->header & BLOCK_POOL_BIT);
+    block_insert(t, block);
+    block_link_next(block)->header = BLOCK_PREV_FREE_BIT;
+  }
+
+  trace_event(t, TLSF_TRACE_FREE_ALL, 0, 0, 0);
+  UNLOCK(t);
+}
+
+#ifdef TLSF_CACHE
+// Return all cached blocks to the regular free lists.
+static void cache_flush(tlsf_t t) {
+  for (unsigned int i = 0; i < SL_INDEX_COUNT; ++i) {
+    block_t block = t->cache[i];
+    while (block) {
+      block_t next = block->next_free;
+      block_free(t, block);
+      block = next;
+    }
+    t->cache[i] = 0;
+    t->cache_count[i] = 0;
+  }
+}
+#endif
+
+#ifdef TLSF_MT
+/*
+ * Return memory to an instance owned by another thread. The block is
+ * pushed onto the owner's remote-free list with a compare-and-swap;
+ * only the owning thread ever pops (an MPSC list), which it does by
+ * exchanging the whole list head at once.
+ */
+void tlsf_free_remote(tlsf_t t, void* mem) {
+  if (!mem)
+    return;
+
+  block_t block = block_from_ptr(mem);
+  ASSERT(!block_is_free(block), "block already marked as free");
+
+  block_t head = atomic_load_explicit(&t->remote, memory_order_relaxed);
+  do {
+    block->next_free = head;
+  } while (!atomic_compare_exchange_weak_explicit(&t->remote, &head, block,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+}
+
+// Free all remotely freed blocks. Must run on the owning thread.
+static void drain_remote(tlsf_t t) {
+  block_t block = atomic_exchange_explicit(&t->remote, 0,
+                                           memory_order_acquire);
+  while (block) {
+    block_t next = block->next_free;
+    do_free(t, block_to_ptr(block));
+    block = next;
+  }
+}
+#endif
+
+/*
+ * TLSF main interface.
+*/
+
+tlsf_t tlsf_create(tlsf_map_t map, tlsf_unmap_t unmap, void* user) {
+  ASSERT(map, "map must not be null");
+  const size_t minsize
+    = TLSF_SIZE + 2 * ALIGN_SIZE + POOL_OVERHEAD + BLOCK_SIZE_MIN;
+  size_t size = minsize;
+  void* mem = map(&size, user);
+  ASSERT(mem, "no memory available");
+  ASSERT(size >= minsize, "not enough memory allocated");
+  ASSERT((size_t)mem % ALIGN_SIZE == 0, "wrong alignment");
+
+  tlsf_t t = (tlsf_t)mem;
+  t->map = map;
+  t->unmap = unmap;
+  t->user = user;
+
+#ifdef TLSF_MT
+  atomic_init(&t->remote, 0);
+#endif
+
+#ifdef TLSF_LOCK
+  pthread_mutex_init(&t->lock, NULL);
+#endif
+
+#ifdef TLSF_CACHE
+  for (unsigned int i = 0; i < SL_INDEX_COUNT; ++i) {
+    t->cache[i] = 0;
+    t->cache_count[i] = 0;
+  }
+#endif
+
+  t->defer = false;
+  t->deferred = 0;
+
+  t->zeromap = false;
+  t->direct = 0;
+  t->bestfit = 0;
+
+  t->check_phase = 0;
+  t->check_fl = 0;
+  t->check_sl = 0;
+  t->check_block = 0;
+  t->check_pool = 0;
+
+  t->pool_head = 0;
+
+  t->standby = 0;
+  t->standby_count = 0;
+  t->standby_max = 0;
+
+  t->extend = 0;
+
+#ifdef TLSF_TRACE
+  t->trace_fd = -1;
+  t->trace_n = 0;
+  t->trace_buf = 0;
+#endif
+
+  memset(&t->metrics, 0, sizeof (t->metrics));
+  t->sample_interval = 0;
+  t->sample_countdown = 0;
+
+#ifdef TLSF_STATS
+  memset(&t->stats, 0, sizeof (t->stats));
+  memset(t->class_hits, 0, sizeof (t->class_hits));
+  memset(t->class_misses, 0, sizeof (t->class_misses));
+#endif
+
+  t->block_null.next_free = &t->block_null;
+  t->block_null.prev_free = &t->block_null;
+
+  t->fl_bitmap = 0;
+  for (unsigned int i = 0; i < FL_INDEX_COUNT; ++i) {
+    t->fl[i].sl_bitmap = 0;
+    for (unsigned int j = 0; j < SL_INDEX_COUNT; ++j)
+      t->fl[i].blocks[j] = &t->block_null;
+  }
+
+  // The pool follows the control structure, padded onto the grid.
+  char* pool = (char*)align_up((size_t)mem + TLSF_SIZE);
+  block_t block = add_pool(t, pool, size - (size_t)(pool - (char*)mem));
+
+  // A capped pool has its sentinel before the region end; do not
+  // extend it (see add_pool).
+  t->last_base = size - TLSF_SIZE - POOL_OVERHEAD > BLOCK_SIZE_MAX ? 0 : mem;
+  t->last_size = (size_t)(pool - (char*)mem) + block_size(block)
+    + POOL_OVERHEAD;
+
+  return t;
+}
+
+/*
+ * Built-in mmap-backed callbacks. Pool sizes are rounded to 2M so the
+ * kernel can back whole pools with huge pages; the create flags pick
+ * between reserved huge pages (MAP_HUGETLB) and transparent ones
+ * (MADV_HUGEPAGE). The flags travel in the user pointer.
+ */
+#define MMAP_ROUND (2ULL * 1024 * 1024)
+
+static void* mmap_map(size_t* size, void* user) {
+  const size_t flags = (size_t)user;
+  *size = MMAP_ROUND * ((*size + MMAP_ROUND - 1) / MMAP_ROUND);
+
+  int mf = MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE;
+#ifdef MAP_HUGETLB
+  // Reserve the huge pages up front, so a shortage fails the mmap
+  // here instead of raising SIGBUS on first touch.
+  if (flags & TLSF_MMAP_HUGETLB)
+    mf = MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB;
+#endif
+
+  void* mem = mmap(0, *size, PROT_READ | PROT_WRITE, mf, -1, 0);
+#ifdef MAP_HUGETLB
+  if (mem == MAP_FAILED && (mf & MAP_HUGETLB)) {
+    // No huge pages available; fall back to regular ones.
+    mf = MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE;
+    mem = mmap(0, *size, PROT_READ | PROT_WRITE, mf, -1, 0);
+  }
+#endif
+  if (mem == MAP_FAILED)
+    return 0;
+
+#ifdef MADV_HUGEPAGE
+  if (flags & TLSF_MMAP_HUGEPAGE)
+    madvise(mem, *size, MADV_HUGEPAGE);
+#endif
+  return mem;
+}
+
+static void mmap_unmap(void* mem, size_t size, void* user) {
+  (void)user;
+  munmap(mem, size);
+}
+
+tlsf_t tlsf_create_mmap(int flags) {
+  tlsf_t t = tlsf_create(mmap_map, mmap_unmap, (void*)(size_t)flags);
+  if (t)
+    tlsf_zeromap(t, 1); // Anonymous mappings are zero filled.
+  return t;
+}
+
+void tlsf_destroy(tlsf_t t) {
+#ifdef TLSF_MT
+  drain_remote(t);
+#endif
+
+#ifdef TLSF_TRACE
+  tlsf_trace_stop(t);
+#endif
+
+  tlsf_flush(t);
+
+#ifdef TLSF_CACHE
+  cache_flush(t);
+#endif
+
+  tlsf_trim(t);
+
+  // tlsf_free_all can leave whole mapped pools in the free lists; give
+  // them back before the control structure goes away.
+  if (t->unmap) {
+    t->standby_max = 0;
+    block_t pool = t->pool_head;
+    while (pool) {
+      block_t next = pool->prev_phys_block;
+      if ((pool->header & BLOCK_POOL_BIT) && block_is_free(pool) &&
+          block_is_last(block_next(pool))) {
+        block_remove(t, pool);
+        remove_pool(t, pool);
+      }
+      pool = next;
+    }
+  }
+
+#ifdef TLSF_STATS
+  ASSERT(t->stats.free_size == t->stats.total_size, "Memory leak detected.");
+  ASSERT((t->unmap && t->stats.pool_count == 1) ||
+         (!t->unmap && t->stats.pool_count >= 1),
+        "Memory leak detected. Some pools were not released.");
+#endif
+
+#ifdef TLSF_LOCK
+  pthread_mutex_destroy(&t->lock);
+#endif
+
+  if (t->unmap) {
+    char* pool = (char*)align_up((size_t)t + TLSF_SIZE);
+    block_t first_block = OFFSET_TO_BLOCK(pool, POOL_FRONT - BLOCK_START_OFFSET);
+    ASSERT(block_is_last(block_next(first_block)), "sentinel should be last");
+    ASSERT(!block_is_free(block_next(first_block)),
+           "sentinel block should not be free");
+    t->unmap(t, (size_t)(pool - (char*)t) + *pool_mapped_size(first_block),
+             t->user);
+  }
+}
+
+/*
+ * Dedicated mapping for an allocation at or above the tlsf_direct
+ * threshold. The region holds a lone block header so tlsf_free can
+ * recognize the block; the prev_phys_block field, which can never name
+ * a physical neighbor, remembers the mapped size for the unmap
+ * callback. Such blocks never enter the segregated lists, so their
+ * size may exceed BLOCK_SIZE_MAX.
+ */
+#define DIRECT_FRONT ((2 * BLOCK_OVERHEAD + ALIGN_SIZE - 1) & \
+                      ~(ALIGN_SIZE - 1))
+
+static void* direct_malloc(tlsf_t t, size_t size, int flags) {
+  if (flags & TLSF_NOMAP)
+    return 0;
+
+  size_t memsize = align_up(size) + DIRECT_FRONT;
+  ++t->metrics.map_calls;
+  void* mem = t->map(&memsize, t->user);
+  if (!mem)
+    return 0;
+  ASSERT((size_t)mem % ALIGN_SIZE == 0, "wrong alignment");
+
+  block_t block = OFFSET_TO_BLOCK(mem, DIRECT_FRONT - BLOCK_START_OFFSET);
+  block->prev_phys_block = (block_t)memsize;
+  block->header = (memsize - DIRECT_FRONT) | BLOCK_DIRECT_BIT;
+
+#ifdef TLSF_STATS
+  ++t->stats.malloc_count;
+  t->stats.total_size += block_size(block);
+  t->stats.used_size += block_size(block);
+#endif
+
+  void* p = block_to_ptr(block);
+  if ((flags & TLSF_ZERO) && !t->zeromap)
+    memset(p, 0, size);
+  trace_event(t, TLSF_TRACE_MALLOC, p, 0, size);
+  return p;
+}
+
+static void direct_free(tlsf_t t, block_t block) {
+#ifdef TLSF_STATS
+  ++t->stats.free_count;
+  ASSERT(t->stats.used_size >= block_size(block), "wrong used");
+  ASSERT(t->stats.total_size >= block_size(block), "wrong total");
+  t->stats.total_size -= block_size(block);
+  t->stats.used_size -= block_size(block);
+#endif
+
+  t->unmap((char*)block_to_ptr(block) - DIRECT_FRONT,
+           (size_t)block->prev_phys_block, t->user);
+}
+
+// A direct mapping has no neighbors to merge with; it shrinks in place
+// and grows by copying into a new mapping (or back into the pools).
+static void* direct_realloc(tlsf_t t, void* mem, size_t size, int flags) {
+  block_t block = block_from_ptr(mem);
+  const size_t cursize = block_size(block);
+
+  if (size <= cursize) {
+    trace_event(t, TLSF_TRACE_REALLOC, mem, mem, size);
+    return mem;
+  }
+
+  if (flags & TLSF_INPLACE)
+    return 0;
+
+  size_t want = size;
+  if (flags & TLSF_GROW)
+    want = size + (size >> 1);
+
+  ++t->metrics.realloc_copies;
+  char* p = (char*)do_mallocx(t, want, flags & TLSF_NOMAP);
+  if (!p && want > size)
+    p = (char*)do_mallocx(t, size, flags & TLSF_NOMAP);
+  if (p) {
+    memcpy(p, mem, cursize);
+    if (flags & TLSF_ZERO)
+      memset(p + cursize, 0, size - cursize);
+    do_free(t, mem);
+  }
+  return p;
+}
+
+static void* do_mallocx(tlsf_t t, size_t size, int flags) {
+  ASSERT((flags & ~(TLSF_ZERO | TLSF_NOMAP | TLSF_HIGH)) == 0,
+         "Invalid flags");
+
+#ifdef TLSF_MT
+  if (atomic_load_explicit(&t->remote, memory_order_relaxed))
+    drain_remote(t);
+#endif
+
+  if (t->direct && size >= t->direct)
+    return direct_malloc(t, size, flags);
+
+  size = adjust_size(size);
+
+#ifdef TLSF_CACHE
+  /*
+   * Small size classes are exact (one size per class below
+   * SMALL_BLOCK_SIZE), so a cached block is always a perfect fit.
+   * A TLSF_HIGH request skips the cache: a recycled scratch address
+   * would land the object at the wrong end of the pool.
+   */
+  if (size < SMALL_BLOCK_SIZE && !(flags & TLSF_HIGH)) {
+    const unsigned int sl
+      = (unsigned int)size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+    block_t cached = t->cache[sl];
+    if (cached) {
+      t->cache[sl] = cached->next_free;
+      --t->cache_count[sl];
+
+#ifdef TLSF_STATS
+      ++t->stats.malloc_count;
+#endif
+
+      void* p = block_to_ptr(cached);
+      if (flags & TLSF_ZERO)
+        memset(p, 0, size);
+      trace_event(t, TLSF_TRACE_MALLOC, p, 0, size);
+      return p;
+    }
+  }
+#endif
+
+  block_t block = block_acquire(t, size, flags);
+  if (!block)
+    return 0;
+
+#ifdef TLSF_STATS
+  ++t->stats.malloc_count;
+#endif
+
+  if (flags & TLSF_HIGH)
+    block = block_trim_free_high(t, block, size);
+  else
+    block_trim_free(t, block, size);
+
+  // Capture the property before block_set_free clears it and scribbles
+  // on the back word again via block_link_next.
+  const bool zero = !!(block->header & BLOCK_ZERO_BIT);
+  block_set_free(block, false);
+
+  void* p = block_to_ptr(block);
+  if (flags & TLSF_ZERO)
+    block_zero(zero, p, size);
+  trace_event(t, TLSF_TRACE_MALLOC, p, 0, size);
+  return p;
+}
+
+// Decide whether this call is sampled; see tlsf_metrics_sample.
+static inline bool metrics_sampled(tlsf_t t) {
+  if (!t->sample_interval || --t->sample_countdown)
+    return false;
+  t->sample_countdown = t->sample_interval;
+  return true;
+}
+
+void* tlsf_mallocx(tlsf_t t, size_t size, int flags) {
+  LOCK(t);
+  void* p;
+  if (!metrics_sampled(t)) {
+    p = do_mallocx(t, size, flags);
+  } else {
+    const uint64_t start = tlsf_cycles();
+    p = do_mallocx(t, size, flags);
+    metrics_record(t->metrics.malloc_hist, tlsf_cycles() - start);
+    ++t->metrics.malloc_samples;
+  }
+  UNLOCK(t);
+  return p;
+}
+
+size_t tlsf_usable_size(tlsf_t t, void* mem) {
+  (void)t;
+  if (!mem)
+    return 0;
+  block_t block = block_from_ptr(mem);
+  ASSERT(!block_is_free(block), "block already marked as free");
+  return block_size(block);
+}
+
+void* tlsf_mallocx_ex(tlsf_t t, size_t size, int flags, size_t* usable) {
+  void* p = tlsf_mallocx(t, size, flags);
+  if (usable)
+    *usable = p ? block_size(block_from_ptr(p)) : 0;
+  return p;
+}
+
+/*
+ * Allocation from a class handle precomputed by tlsf_size_class (see
+ * tlsf.h), which packs the adjusted size with the (fl, sl) indices of
+ * the rounded search class. Constant-size call sites resolve the
+ * handle at compile time, so the runtime fast path is a cache probe
+ * or a head pop from a list whose every block is known to fit.
+ * Everything else - an empty list, the direct threshold, the best-fit
+ * policy - falls back to the general path.
+ */
+void* tlsf_malloc_class(tlsf_t t, size_t cls) {
+  const size_t size = cls >> 12;
+  const unsigned int fl = (unsigned int)(cls >> 6) & 0x3f;
+  const unsigned int sl = (unsigned int)cls & 0x3f;
+  ASSERT(fl < FL_INDEX_COUNT, "Wrong fl index count");
+  ASSERT(sl < SL_INDEX_COUNT, "Wrong sl index count");
+  ASSERT(size == adjust_size(size), "class size not adjusted");
+
+  LOCK(t);
+
+#ifdef TLSF_MT
+  if (atomic_load_explicit(&t->remote, memory_order_relaxed))
+    drain_remote(t);
+#endif
+
+#ifdef TLSF_CACHE
+  // Small classes are exact, and their cache index is just sl.
+  if (size < SMALL_BLOCK_SIZE) {
+    block_t cached = t->cache[sl];
+    if (cached) {
+      t->cache[sl] = cached->next_free;
+      --t->cache_count[sl];
+
+#ifdef TLSF_STATS
+      ++t->stats.malloc_count;
+#endif
+
+      void* p = block_to_ptr(cached);
+      trace_event(t, TLSF_TRACE_MALLOC, p, 0, size);
+      UNLOCK(t);
+      return p;
+    }
+  }
+#endif
+
+  block_t block = t->fl[fl].blocks[sl];
+  if (block != &t->block_null && !t->bestfit
+      && !(t->direct && size >= t->direct)) {
+    ASSERT(block_size(block) >= size, "insufficient block size");
+    remove_free_block(t, block, fl, sl);
+
+#ifdef TLSF_STATS
+    ++t->class_hits[fl][sl];
+    ++t->stats.malloc_count;
+#endif
+
+    block_trim_free(t, block, size);
+    block_set_free(block, false);
+
+    void* p = block_to_ptr(block);
+    trace_event(t, TLSF_TRACE_MALLOC, p, 0, size);
+    UNLOCK(t);
+    return p;
+  }
+
+  void* p = do_mallocx(t, size, 0);
+  UNLOCK(t);
+  return p;
+}
+
+/*
+ * Aligned allocation. The block is over-allocated by the alignment and
+ * the leading gap is split off and returned to the free lists, so an
+ * aligned block costs no more memory than an unaligned one and is
+ * freed like any other block.
+ */
+static void* do_memalignx(tlsf_t t, size_t align, size_t size, int flags) {
+#ifdef TLSF_MT
+  if (atomic_load_explicit(&t->remote, memory_order_relaxed))
+    drain_remote(t);
+#endif
+
+  size = adjust_size(size);
+
+  /*
+   * A leading gap must be splittable into a free block of its own, so
+   * it is either zero or at least BLOCK_SIZE_MIN plus a header.
+   */
+  const size_t gap_min = BLOCK_SIZE_MIN + BLOCK_OVERHEAD;
+
+  block_t block = block_acquire(t, size + align + gap_min, flags);
+  if (!block)
+    return 0;
+
+  const size_t addr = (size_t)block_to_ptr(block);
+  size_t gap = (align - addr % align) % align;
+  while (gap && gap < gap_min)
+    gap += align;
+
+  if (gap) {
+    // Split the gap off the front and give it back to the free lists.
+    block_t remaining = block_split(block, gap - BLOCK_OVERHEAD);
+    block_link_next(block);
+    block_set_prev_free(remaining, true);
+    block_insert(t, block);
+    block = remaining;
+  }
+
+#ifdef TLSF_STATS
+  ++t->stats.malloc_count;
+#endif
+
+  block_trim_free(t, block, size);
+
+  const bool zero = !!(block->header & BLOCK_ZERO_BIT);
+  block_set_free(block, false);
+
+  void* p = block_to_ptr(block);
+  ASSERT((size_t)p % align == 0, "block not aligned properly");
+  if (flags & TLSF_ZERO)
+    block_zero(zero, p, size);
+  trace_event(t, TLSF_TRACE_MALLOC, p, 0, size);
+  return p;
+}
+
+void* tlsf_memalignx(tlsf_t t, size_t align, size_t size, int flags) {
+  ASSERT((flags & ~(TLSF_ZERO | TLSF_NOMAP)) == 0, "Invalid flags");
+  ASSERT(align && !(align & (align - 1)), "align must be a power of two");
+
+  // The word alignment every block already has.
+  if (align <= ALIGN_SIZE)
+    return tlsf_mallocx(t, size, flags);
+
+  LOCK(t);
+  void* p = do_memalignx(t, align, size, flags);
+  UNLOCK(t);
+  return p;
+}
+
+static void do_free(tlsf_t t, void* mem) {
+  if (!mem) // to support free after zero size realloc
+    return;
+
+  block_t block = block_from_ptr(mem);
+  ASSERT(!block_is_free(block), "block already marked as free");
+
+  trace_event(t, TLSF_TRACE_FREE, mem, 0, 0);
+
+  if (block->header & BLOCK_DIRECT_BIT) {
+    direct_free(t, block);
+    return;
+  }
+
+#ifdef TLSF_STATS
+  ++t->stats.free_count;
+#endif
+
+#ifdef TLSF_CACHE
+  /*
+   * Only sizes adjust_size can produce are cacheable; off-grid blocks
+   * (the front of a capped pool) would sit in the cache unmatched
+   * forever. The test is compile-time true for the default alignment.
+   */
+  const size_t size = block_size(block);
+  if (size < SMALL_BLOCK_SIZE
+      && (size + BLOCK_OVERHEAD) % ALIGN_SIZE == 0) {
+    const unsigned int sl
+      = (unsigned int)size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+    if (t->cache_count[sl] < TLSF_CACHE_DEPTH) {
+      block->next_free = t->cache[sl];
+      t->cache[sl] = block;
+      ++t->cache_count[sl];
+      return;
+    }
+  }
+#endif
+
+  if (t->defer) {
+    block->next_free = t->deferred;
+    t->deferred = block;
+    return;
+  }
+
+  block_free(t, block);
+}
+
+void tlsf_free(tlsf_t t, void* mem) {
+  LOCK(t);
+  if (!metrics_sampled(t)) {
+    do_free(t, mem);
+  } else {
+    const uint64_t start = tlsf_cycles();
+    do_free(t, mem);
+    metrics_record(t->metrics.free_hist, tlsf_cycles() - start);
+    ++t->metrics.free_samples;
+  }
+  UNLOCK(t);
+}
+
+/*
+ * Allocate count blocks of the same size. Instead of paying the full
+ * mapping_insert/search_suitable_block cost per block, each free block
+ * found is carved into as many same-size blocks as it can hold in a
+ * single split pass, so the bitmap and free list are touched once per
+ * source block rather than once per allocation.
+ */
+size_t tlsf_malloc_bulk(tlsf_t t, size_t size, void** out, size_t count,
+                        int flags) {
+  ASSERT((flags & ~(TLSF_ZERO | TLSF_NOMAP)) == 0, "Invalid flags");
+
+  LOCK(t);
+
+#ifdef TLSF_MT
+  if (atomic_load_explicit(&t->remote, memory_order_relaxed))
+    drain_remote(t);
+#endif
+
+  size = adjust_size(size);
+
+  size_t done = 0;
+  while (done < count) {
+    block_t block = block_locate_free(t, size);
+    if (!block) {
+      if (t->deferred) {
+        do_flush(t);
+        continue;
+      }
+      if (revive_pool(t, round_block_size(size)))
+        continue;
+      if (flags & TLSF_NOMAP)
+        break;
+      if (try_extend(t, (count - done) * (round_block_size(size)
+                                          + BLOCK_OVERHEAD)))
+        continue;
+      // Size the new pool for the whole remainder of the batch.
+      size_t minsize = POOL_OVERHEAD + ALIGN_SIZE
+        + (count - done) * (round_block_size(size) + BLOCK_OVERHEAD);
+      size_t memsize = minsize;
+      ++t->metrics.map_calls;
+      void* mem = t->map(&memsize, t->user);
+      if (!mem)
+        break;
+      ASSERT(memsize >= minsize, "not enough memory allocated");
+      block_t pool = add_pool(t, (char*)mem, memsize);
+      pool->header |= BLOCK_POOL_BIT;
+      t->last_base = memsize - POOL_OVERHEAD > BLOCK_SIZE_MAX ? 0 : mem;
+      t->last_size = block_size(pool) + POOL_OVERHEAD;
+      continue;
+    }
+
+    // Carve same-size blocks off the front until the block is used up.
+    for (;;) {
+      /*
+       * Repeated splits leave a terminal fragment that is only
+       * guaranteed to be a valid free block, not to hold size bytes;
+       * give an undersized one back rather than handing it out.
+       */
+      if (block_size(block) < size) {
+        block_insert(t, block);
+        break;
+      }
+
+#ifdef TLSF_STATS
+      ++t->stats.malloc_count;
+#endif
+      const bool zero = !!(block->header & BLOCK_ZERO_BIT);
+      if (done + 1 < count && block_can_split(block, size)) {
+        block_t remaining = block_split(block, size);
+        block_set_free(block, false);
+        if (flags & TLSF_ZERO)
+          block_zero(zero, block_to_ptr(block), size);
+        out[done++] = block_to_ptr(block);
+        block = remaining;
+      } else {
+        block_trim_free(t, block, size);
+        block_set_free(block, false);
+        if (flags & TLSF_ZERO)
+          block_zero(zero, block_to_ptr(block), size);
+        out[done++] = block_to_ptr(block);
+        break;
+      }
+    }
+  }
+#ifdef TLSF_TRACE
+  for (size_t i = 0; i < done; ++i)
+    trace_event(t, TLSF_TRACE_MALLOC, out[i], 0, size);
+#endif
+  UNLOCK(t);
+  return done;
+}
+
+/*
+ * Free count blocks in one critical section, so the lock is taken and
+ * the remote queue drained once per batch rather than once per block.
+ */
+void tlsf_free_bulk(tlsf_t t, void** mem, size_t count) {
+  LOCK(t);
+
+#ifdef TLSF_MT
+  if (atomic_load_explicit(&t->remote, memory_order_relaxed))
+    drain_remote(t);
+#endif
+
+  for (size_t i = 0; i < count; ++i)
+    do_free(t, mem[i]);
+  UNLOCK(t);
+}
+
+/*
+ * The TLSF block information provides us with enough information to
+ * provide a reasonably intelligent implementation of realloc, growing or
+ * shrinking the currently allocated block as required.
+ *
+ * This routine handles the somewhat esoteric edge cases of realloc:
+ * - a non-zero size with a null pointer will behave like malloc
+ * - a zero size with a non-null pointer will behave like free
+ * - a request that cannot be satisfied will leave the original buffer
+ *   untouched
+ * - an extended buffer size will leave the newly-allocated area with
+ *   contents undefined
+ */
+static void* do_reallocx(tlsf_t t, void* mem, size_t size, int flags) {
+  block_t block = block_from_ptr(mem);
+  ASSERT(!block_is_free(block), "block already marked as free");
+
+  if (block->header & BLOCK_DIRECT_BIT)
+    return direct_realloc(t, mem, size, flags);
+
+  block_t next = block_next(block);
+
+  const size_t cursize = block_size(block);
+  const size_t combined = cursize + block_size(next) + BLOCK_OVERHEAD;
+  size = adjust_size(size);
+
+  /*
+   * With TLSF_GROW an extended block keeps geometric headroom, so a
+   * buffer appended to in a loop takes the cheap merge path instead of
+   * re-splitting the successor block on every call.
+   */
+  size_t want = size;
+  if ((flags & TLSF_GROW) && size > cursize) {
+    want = size + (size >> 1);
+    if (want > TLSF_MAX_SIZE)
+      want = TLSF_MAX_SIZE;
+    want = adjust_size(want);
+  }
+
+  /*
+   * If the next block is used, or when combined with the current
+   * block, does not offer enough space, we must reallocate and copy.
+   */
+  if (size > cursize && (!block_is_free(next) || size > combined)) {
+    if (flags & TLSF_INPLACE)
+      return 0;
+    ++t->metrics.realloc_copies;
+    char* p = (char*)do_mallocx(t, want, flags & TLSF_NOMAP);
+    if (!p && want > size)
+      p = (char*)do_mallocx(t, size, flags & TLSF_NOMAP);
+    if (p) {
+      memcpy(p, mem, cursize);
       if (flags & TLSF_ZERO)
         memset(p + cursize, 0, size - cursize);
-      tlsf_free(t, mem);
+      do_free(t, mem);
     }
     return p;
   }
@@ -731,15 +2056,495 @@ void* tlsf_reallocx(tlsf_t t, void* mem, size_t size, int flags) {
   }
 
   // Trim the resulting block and return the original pointer.
-  block_trim_used(t, block, size);
+  block_trim_used(t, block, want);
+  trace_event(t, TLSF_TRACE_REALLOC, mem, mem, size);
   return mem;
 }
 
+void* tlsf_reallocx(tlsf_t t, void* mem, size_t size, int flags) {
+  ASSERT((flags & ~(TLSF_ZERO | TLSF_NOMAP | TLSF_INPLACE | TLSF_GROW)) == 0,
+         "Invalid flags");
+
+  // Zero-size requests are treated as free.
+  if (mem && size == 0) {
+    tlsf_free(t, mem);
+    return 0;
+  }
+
+  // Requests with NULL pointers are treated as malloc.
+  if (!mem)
+    return tlsf_mallocx(t, size, flags & (TLSF_ZERO | TLSF_NOMAP));
+
+  LOCK(t);
+  void* p = do_reallocx(t, mem, size, flags);
+  UNLOCK(t);
+  return p;
+}
+
+/*
+ * NUMA instance groups, see tlsf.h. The group is a thin routing layer:
+ * each node's instance is an ordinary self-hosted tlsf_s whose
+ * callbacks are trampolines adding the node to the shared pair, so the
+ * user's map callback can place every pool on the right node. The
+ * group header is mapped through the node-0 callback, like an
+ * instance's control structure is mapped through its own.
+ */
+typedef struct {
+  struct tlsf_group_s* group;
+  unsigned int node;
+  tlsf_t t;
+} tlsf_group_node_t;
+
+struct tlsf_group_s {
+  unsigned int       nodes;
+  size_t             mapped; // size of the group header mapping
+  tlsf_group_map_t   map;
+  tlsf_group_unmap_t unmap;
+  void*              user;
+  tlsf_group_node_t  node[];
+};
+
+static void* group_map(size_t* min_size, void* user) {
+  tlsf_group_node_t* n = (tlsf_group_node_t*)user;
+  return n->group->map(min_size, n->node, n->group->user);
+}
+
+static void group_unmap(void* mem, size_t size, void* user) {
+  tlsf_group_node_t* n = (tlsf_group_node_t*)user;
+  n->group->unmap(mem, size, n->node, n->group->user);
+}
+
+tlsf_group_t tlsf_group_create(unsigned int nodes, tlsf_group_map_t map,
+                               tlsf_group_unmap_t unmap, void* user) {
+  ASSERT(nodes, "a group needs at least one node");
+  ASSERT(map, "map must not be null");
+
+  size_t size
+    = sizeof (struct tlsf_group_s) + nodes * sizeof (tlsf_group_node_t);
+  tlsf_group_t g = (tlsf_group_t)map(&size, 0, user);
+  if (!g)
+    return 0;
+
+  g->nodes = nodes;
+  g->mapped = size;
+  g->map = map;
+  g->unmap = unmap;
+  g->user = user;
+
+  for (unsigned int i = 0; i < nodes; ++i) {
+    g->node[i].group = g;
+    g->node[i].node = i;
+    g->node[i].t
+      = tlsf_create(group_map, unmap ? group_unmap : NULL, &g->node[i]);
+    if (!g->node[i].t) {
+      while (i--)
+        tlsf_destroy(g->node[i].t);
+      if (unmap)
+        unmap(g, g->mapped, 0, user);
+      return 0;
+    }
+  }
+  return g;
+}
+
+void tlsf_group_destroy(tlsf_group_t g) {
+  for (unsigned int i = 0; i < g->nodes; ++i)
+    tlsf_destroy(g->node[i].t);
+  if (g->unmap)
+    g->unmap(g, g->mapped, 0, g->user);
+}
+
+unsigned int tlsf_group_nodes(tlsf_group_t g) {
+  return g->nodes;
+}
+
+tlsf_t tlsf_group_get(tlsf_group_t g, unsigned int node) {
+  ASSERT(node < g->nodes, "no such node");
+  return g->node[node].t;
+}
+
+// Route by the caller's current node; callers on a hot path should
+// cache the result for the duration of their node affinity.
+tlsf_t tlsf_group_local(tlsf_group_t g) {
+  unsigned int cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+    node = 0;
+  return g->node[node % g->nodes].t;
+}
+
+/*
+ * Heap snapshot and restore, see tlsf.h. The image is the header, then
+ * one record and the raw bytes per region: first the control mapping
+ * (which carries the instance's own pool behind it), then the other
+ * chained pools, then the parked standby pools. Every pointer the
+ * regions embed names either another spot in some region or nothing,
+ * so restore relocates by per-region offset; block traversal itself is
+ * size-based and needs no fixups.
+ */
+#define TLSF_IMAGE_MAGIC   0x49534c54u // "TLSI"
+#define TLSF_IMAGE_VERSION 3 // 3: mapped-size word in the pool front
+
+// Compile-time layout fingerprint; images do not cross variants.
+#define TLSF_IMAGE_GEOMETRY \
+  ((TLSF_SIZE << 16) ^ (FL_INDEX_COUNT << 10) ^ (SL_INDEX_COUNT << 4) \
+   ^ ALIGN_SIZE_SHIFT)
+
+typedef struct {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int wordsize;
+  unsigned int regions;
+  size_t geometry;
+} tlsf_image_header_t;
+
+typedef struct {
+  size_t base;
+  size_t size;
+} tlsf_image_record_t;
+
+typedef struct {
+  size_t old_base;
+  size_t size;
+  char*  mem;
+} image_region_t;
+
+static bool image_write(int fd, const void* buf, size_t len) {
+  const char* p = (const char*)buf;
+  while (len) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool image_read(int fd, void* buf, size_t len) {
+  char* p = (char*)buf;
+  while (len) {
+    ssize_t n = read(fd, p, len);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static block_t pool_last(block_t block) {
+  while (!block_is_last(block))
+    block = block_next(block);
+  return block;
+}
+
+// The pool the control structure shares its mapping with.
+static block_t own_pool(tlsf_t t) {
+  char* pool = (char*)align_up((size_t)t + TLSF_SIZE);
+  return OFFSET_TO_BLOCK(pool, POOL_FRONT - BLOCK_START_OFFSET);
+}
+
+static bool image_write_region(int fd, const void* base, size_t size) {
+  const tlsf_image_record_t rec = {(size_t)base, size};
+  return image_write(fd, &rec, sizeof (rec)) && image_write(fd, base, size);
+}
+
+int tlsf_save(tlsf_t t, int fd) {
+#ifdef TLSF_TRACE
+  if (t->trace_fd >= 0)
+    return -1; // the trace buffer must not outlive its fd
+#endif
+
+  LOCK(t);
+
+#ifdef TLSF_MT
+  drain_remote(t);
+#endif
+
+  block_t own = own_pool(t);
+  unsigned int regions = 1;
+  for (block_t pool = t->pool_head; pool; pool = pool->prev_phys_block)
+    if (pool != own)
+      ++regions;
+  regions += t->standby_count;
+
+  const tlsf_image_header_t header
+    = {TLSF_IMAGE_MAGIC, TLSF_IMAGE_VERSION, __WORDSIZE, regions,
+       TLSF_IMAGE_GEOMETRY};
+  bool ok = image_write(fd, &header, sizeof (header));
+
+  ok = ok && image_write_region(fd, t,
+    (size_t)((char*)pool_last(own) + 2 * BLOCK_OVERHEAD - (char*)t));
+
+  for (block_t pool = t->pool_head; ok && pool;
+       pool = pool->prev_phys_block) {
+    if (pool == own)
+      continue;
+    char* base = (char*)block_to_ptr(pool) - POOL_FRONT;
+    ok = image_write_region(fd, base,
+      (size_t)((char*)pool_last(pool) + 2 * BLOCK_OVERHEAD - base));
+  }
+
+  for (block_t pool = t->standby; ok && pool; pool = pool->next_free)
+    ok = image_write_region(fd, (char*)block_to_ptr(pool) - POOL_FRONT,
+                            block_size(pool) + POOL_OVERHEAD);
+
+  UNLOCK(t);
+  return ok ? 0 : -1;
+}
+
+static void* image_reloc(void* p, const image_region_t* r, unsigned int n) {
+  const size_t v = (size_t)p;
+  for (unsigned int i = 0; i < n; ++i)
+    if (v - r[i].old_base < r[i].size)
+      return r[i].mem + (v - r[i].old_base);
+  return p;
+}
+
+tlsf_t tlsf_restore(int fd, tlsf_map_t map, tlsf_unmap_t unmap, void* user) {
+  ASSERT(map, "map must not be null");
+
+  tlsf_image_header_t header;
+  if (!image_read(fd, &header, sizeof (header))
+      || header.magic != TLSF_IMAGE_MAGIC
+      || header.version != TLSF_IMAGE_VERSION
+      || header.wordsize != __WORDSIZE
+      || header.geometry != TLSF_IMAGE_GEOMETRY
+      || header.regions == 0)
+    return 0;
+
+  // Scratch relocation table, returned before the instance goes live.
+  size_t scratch = header.regions * sizeof (image_region_t);
+  image_region_t* r = (image_region_t*)map(&scratch, user);
+  if (!r)
+    return 0;
+
+  unsigned int n = 0;
+  bool ok = true;
+  for (; ok && n < header.regions; ++n) {
+    tlsf_image_record_t rec;
+    ok = image_read(fd, &rec, sizeof (rec));
+    if (!ok)
+      break;
+    size_t memsize = rec.size;
+    char* mem = ok ? (char*)map(&memsize, user) : 0;
+    if (!mem) {
+      ok = false;
+      break;
+    }
+    ASSERT((size_t)mem % ALIGN_SIZE == 0, "wrong alignment");
+    r[n].old_base = rec.base;
+    r[n].size = rec.size;
+    r[n].mem = mem;
+    ok = image_read(fd, mem, rec.size);
+    if (!ok) {
+      if (unmap)
+        unmap(mem, rec.size, user);
+      break;
+    }
+    /*
+     * The image carries the saving process's mapped size; overwrite it
+     * with what this map call actually granted. Region 0 holds the
+     * control structure in front of its pool.
+     */
+    char* pool = n == 0 ? (char*)align_up((size_t)mem + TLSF_SIZE) : mem;
+    block_t first = OFFSET_TO_BLOCK(pool, POOL_FRONT - BLOCK_START_OFFSET);
+    *pool_mapped_size(first) = memsize - (size_t)(pool - mem);
+  }
+
+  if (!ok) {
+    if (unmap) {
+      while (n--)
+        unmap(r[n].mem, r[n].size, user);
+      unmap(r, scratch, user);
+    }
+    return 0;
+  }
+
+  tlsf_t t = (tlsf_t)r[0].mem;
+  t->map = map;
+  t->unmap = unmap;
+  t->user = user;
+
+#ifdef TLSF_MT
+  atomic_init(&t->remote, 0);
+#endif
+
+#ifdef TLSF_LOCK
+  pthread_mutex_init(&t->lock, NULL);
+#endif
+
+  t->block_null.next_free
+    = (block_t)image_reloc(t->block_null.next_free, r, n);
+  t->block_null.prev_free
+    = (block_t)image_reloc(t->block_null.prev_free, r, n);
+  for (unsigned int fl = 0; fl < FL_INDEX_COUNT; ++fl)
+    for (unsigned int sl = 0; sl < SL_INDEX_COUNT; ++sl)
+      t->fl[fl].blocks[sl]
+        = (block_t)image_reloc(t->fl[fl].blocks[sl], r, n);
+
+#ifdef TLSF_CACHE
+  for (unsigned int sl = 0; sl < SL_INDEX_COUNT; ++sl) {
+    t->cache[sl] = (block_t)image_reloc(t->cache[sl], r, n);
+    for (block_t block = t->cache[sl]; block; block = block->next_free)
+      block->next_free = (block_t)image_reloc(block->next_free, r, n);
+  }
+#endif
+
+  t->deferred = (block_t)image_reloc(t->deferred, r, n);
+  for (block_t block = t->deferred; block; block = block->next_free)
+    block->next_free = (block_t)image_reloc(block->next_free, r, n);
+
+  t->pool_head = (block_t)image_reloc(t->pool_head, r, n);
+  for (block_t pool = t->pool_head; pool; pool = pool->prev_phys_block) {
+    pool->prev_phys_block
+      = (block_t)image_reloc(pool->prev_phys_block, r, n);
+    *pool_prev_link(pool) = (block_t)image_reloc(*pool_prev_link(pool), r, n);
+  }
+
+  t->standby = (block_t)image_reloc(t->standby, r, n);
+
+  // The mapped addresses are new; extension state does not survive.
+  t->extend = 0;
+  t->last_base = 0;
+  t->last_size = 0;
+
+  // Neither does the incremental checker's cursor.
+  t->check_phase = 0;
+  t->check_fl = 0;
+  t->check_sl = 0;
+  t->check_block = 0;
+  t->check_pool = 0;
+
+#ifdef TLSF_TRACE
+  t->trace_fd = -1;
+  t->trace_buf = 0;
+  t->trace_n = 0;
+#endif
+
+  /*
+   * Fix the free blocks of every region: the list links relocate, and
+   * relinking rewrites the prev_phys_block word each free block owns
+   * at its neighbor. Standby chain links fall out of the same pass,
+   * since a parked pool is one maximal free block.
+   */
+  for (unsigned int i = 0; i < n; ++i) {
+    block_t block = i == 0 ? own_pool(t)
+      : OFFSET_TO_BLOCK(r[i].mem, POOL_FRONT - BLOCK_START_OFFSET);
+    for (; !block_is_last(block); block = block_next(block)) {
+      if (!block_is_free(block))
+        continue;
+      block->next_free = (block_t)image_reloc(block->next_free, r, n);
+      block->prev_free = (block_t)image_reloc(block->prev_free, r, n);
+      block_link_next(block);
+    }
+  }
+
+  if (unmap)
+    unmap(r, scratch, user);
+  return t;
+}
+
+#ifdef TLSF_TRACE
+/*
+ * Start recording into fd. The event buffer lives in the instance's
+ * own heap; it is allocated before tracing is enabled, so the
+ * allocation itself does not appear in the trace.
+ */
+int tlsf_trace_start(tlsf_t t, int fd) {
+  if (t->trace_fd >= 0)
+    return -1;
+
+  tlsf_trace_event_t* buf = (tlsf_trace_event_t*)
+    tlsf_malloc(t, TLSF_TRACE_EVENTS * sizeof (tlsf_trace_event_t));
+  if (!buf)
+    return -1;
+
+  const tlsf_trace_header_t header
+    = {TLSF_TRACE_MAGIC, TLSF_TRACE_VERSION, __WORDSIZE, 0};
+  if (write(fd, &header, sizeof (header)) != sizeof (header)) {
+    tlsf_free(t, buf);
+    return -1;
+  }
+
+  t->trace_buf = buf;
+  t->trace_n = 0;
+  t->trace_fd = fd;
+  return 0;
+}
+
+void tlsf_trace_stop(tlsf_t t) {
+  if (t->trace_fd < 0)
+    return;
+  trace_flush(t);
+  t->trace_fd = -1;
+  tlsf_free(t, t->trace_buf);
+  t->trace_buf = 0;
+}
+#endif
+
+void tlsf_walk(tlsf_t t, tlsf_walk_t walk, void* user) {
+  LOCK(t);
+  for (block_t pool = t->pool_head; pool; pool = pool->prev_phys_block) {
+    // The pool spans its front words up to the sentinel header.
+    block_t last = pool;
+    while (!block_is_last(last))
+      last = block_next(last);
+    char* base = (char*)block_to_ptr(pool) - POOL_FRONT;
+    walk(base, (size_t)((char*)last + 2 * BLOCK_OVERHEAD - base),
+         TLSF_WALK_POOL, user);
+
+    for (block_t block = pool; !block_is_last(block);
+         block = block_next(block))
+      walk(block_to_ptr(block), block_size(block),
+           block_is_free(block) ? TLSF_WALK_FREE : TLSF_WALK_USED, user);
+  }
+  UNLOCK(t);
+}
+
+void tlsf_fragmentation(tlsf_t t, tlsf_frag_t* frag) {
+  memset(frag, 0, sizeof (*frag));
+  LOCK(t);
+  for (block_t pool = t->pool_head; pool; pool = pool->prev_phys_block) {
+    ++frag->pool_count;
+    for (block_t block = pool; !block_is_last(block);
+         block = block_next(block)) {
+      if (!block_is_free(block))
+        continue;
+      const size_t size = block_size(block);
+      ++frag->free_blocks;
+      frag->free_size += size;
+      if (size > frag->largest_free)
+        frag->largest_free = size;
+      ++frag->free_hist[tlsf_fls(size)];
+    }
+  }
+  UNLOCK(t);
+}
+
+const tlsf_metrics_t* tlsf_metrics(tlsf_t t) {
+  return &t->metrics;
+}
+
+void tlsf_metrics_sample(tlsf_t t, size_t interval) {
+  t->sample_interval = interval;
+  t->sample_countdown = interval;
+}
+
 #ifdef TLSF_STATS
 const tlsf_stats_t* tlsf_stats(tlsf_t t) {
   return &t->stats;
 }
 
+int tlsf_class_stats(tlsf_t t, unsigned int fl, unsigned int sl,
+                     size_t* hits, size_t* misses) {
+  if (fl >= FL_INDEX_COUNT || sl >= SL_INDEX_COUNT)
+    return 0;
+  *hits = t->class_hits[fl][sl];
+  *misses = t->class_misses[fl][sl];
+  return 1;
+}
+
 void tlsf_printstats(tlsf_t t) {
   tlsf_stats_t* s = &t->stats;
   fprintf(stderr, "TSLF free_size=%llu used_size=%llu total_size=%llu "
@@ -749,6 +2554,141 @@ void tlsf_printstats(tlsf_t t) {
 }
 #endif
 
+/*
+ * Incremental integrity checking. Unlike tlsf_check this is compiled
+ * unconditionally: it reports corruption as a return value instead of
+ * aborting, and each call validates at most a caller-chosen number of
+ * blocks, so it can run continuously on a production heap at a bounded
+ * cost per call.
+ */
+#define STEP_INSIST(cond, msg)                                \
+  do {                                                        \
+    if (!(cond)) {                                            \
+      fprintf(stderr, "TLSF FAILURE: %s - %s\n", msg, #cond); \
+      goto fail;                                              \
+    }                                                         \
+  } while (0)
+
+int tlsf_check_step(tlsf_t t, size_t budget) {
+  int done = 0;
+  LOCK(t);
+
+  while (budget) {
+    if (!t->check_phase) {
+      // Phase 0: one free list per iteration, resumable mid-list.
+      const unsigned int i = t->check_fl;
+      const unsigned int j = t->check_sl;
+      block_t block = t->check_block;
+
+      if (!block) {
+        const size_t fl_map = t->fl_bitmap & (1ULL << i);
+        const size_t sl_list = t->fl[i].sl_bitmap;
+        const size_t sl_map = sl_list & (1ULL << j);
+        block = t->fl[i].blocks[j];
+
+        // Check that first- and second-level lists agree.
+        if (!fl_map)
+          STEP_INSIST(!sl_map, "second-level map must be null");
+
+        if (!sl_map)
+          STEP_INSIST(block == &t->block_null, "block list must be null");
+        else {
+          STEP_INSIST(sl_list, "no free blocks in second-level map");
+          STEP_INSIST(block != &t->block_null, "block should not be null");
+        }
+      }
+
+      while (block != &t->block_null && budget) {
+        unsigned int fli, sli;
+        STEP_INSIST(block_is_free(block), "block should be free");
+        STEP_INSIST(!block_is_prev_free(block), "blocks should have coalesced");
+        STEP_INSIST(!block_is_free(block_next(block)),
+                    "blocks should have coalesced");
+        STEP_INSIST(block_is_prev_free(block_next(block)),
+                    "block should be free");
+        STEP_INSIST(block_size(block) >= BLOCK_SIZE_MIN,
+                    "block not minimum size");
+
+        mapping_insert(block_size(block), &fli, &sli);
+        STEP_INSIST(fli == i && sli == j, "block size indexed in wrong list");
+        block = block->next_free;
+        --budget;
+      }
+
+      if (block != &t->block_null) {
+        t->check_block = block;
+        continue;
+      }
+
+      // An empty list still costs a step, keeping the call bounded.
+      if (budget)
+        --budget;
+      t->check_block = 0;
+      if (++t->check_sl == SL_INDEX_COUNT) {
+        t->check_sl = 0;
+        if (++t->check_fl == FL_INDEX_COUNT) {
+          t->check_fl = 0;
+          t->check_phase = 1;
+          t->check_pool = t->pool_head;
+        }
+      }
+    } else {
+      // Phase 1: the physical block chain of one pool per iteration.
+      block_t pool = t->check_pool;
+      if (!pool) {
+#ifdef TLSF_STATS
+        STEP_INSIST(t->stats.free_size + t->stats.used_size
+                      == t->stats.total_size,
+                    "wrong total memory");
+        STEP_INSIST(t->stats.free_count <= t->stats.malloc_count,
+                    "wrong free and malloc count");
+#endif
+        t->check_phase = 0;
+        done = 1;
+        break;
+      }
+
+      block_t block = t->check_block ? t->check_block : pool;
+      if (block == pool)
+        STEP_INSIST(!block_is_prev_free(pool),
+                    "first block cannot have a neighbor");
+
+      while (!block_is_last(block) && budget) {
+        STEP_INSIST(block_size(block) >= BLOCK_SIZE_MIN,
+                    "block not minimum size");
+        block_t next = block_next(block);
+        STEP_INSIST(block_is_free(block) == block_is_prev_free(next),
+                    "neighbor status bit out of sync");
+        if (block_is_free(block))
+          STEP_INSIST(next->prev_phys_block == block, "wrong physical link");
+        block = next;
+        --budget;
+      }
+
+      if (!block_is_last(block)) {
+        t->check_block = block;
+        continue;
+      }
+
+      STEP_INSIST(!block_is_free(block), "sentinel block should not be free");
+      t->check_block = 0;
+      t->check_pool = pool->prev_phys_block;
+    }
+  }
+
+  UNLOCK(t);
+  return done;
+
+fail:
+  t->check_phase = 0;
+  t->check_fl = 0;
+  t->check_sl = 0;
+  t->check_block = 0;
+  t->check_pool = 0;
+  UNLOCK(t);
+  return -1;
+}
+
 /*
  * Debugging utilities.
  */
@@ -762,13 +2702,15 @@ void tlsf_printstats(tlsf_t t) {
   } while (0)
 
 void tlsf_check(tlsf_t t) {
+  LOCK(t);
+
   // Check that the free lists and bitmaps are accurate.
   for (unsigned int i = 0; i < FL_INDEX_COUNT; ++i) {
     for (unsigned int j = 0; j < SL_INDEX_COUNT; ++j) {
       const size_t fl_map = t->fl_bitmap & (1ULL << i);
-      const size_t sl_list = t->sl_bitmap[i];
+      const size_t sl_list = t->fl[i].sl_bitmap;
       const size_t sl_map = sl_list & (1ULL << j);
-      block_t block = t->blocks[i][j];
+      block_t block = t->fl[i].blocks[j];
 
       // Check that first- and second-level lists agree.
       if (!fl_map)
@@ -798,9 +2740,27 @@ void tlsf_check(tlsf_t t) {
       }
     }
   }
+  // Check that every pool is a consistent chain of physical blocks.
+  for (block_t pool = t->pool_head; pool; pool = pool->prev_phys_block) {
+    INSIST(!block_is_prev_free(pool), "first block cannot have a neighbor");
+    block_t block = pool;
+    while (!block_is_last(block)) {
+      INSIST(block_size(block) >= BLOCK_SIZE_MIN, "block not minimum size");
+      block_t next = block_next(block);
+      INSIST(block_is_free(block) == block_is_prev_free(next),
+             "neighbor status bit out of sync");
+      if (block_is_free(block))
+        INSIST(next->prev_phys_block == block, "wrong physical link");
+      block = next;
+    }
+    INSIST(!block_is_free(block), "sentinel block should not be free");
+  }
+
   INSIST(t->stats.free_size + t->stats.used_size == t->stats.total_size,
          "wrong total memory");
   INSIST(t->stats.free_count <= t->stats.malloc_count,
          "wrong free and malloc count");
+
+  UNLOCK(t);
 }
 #endif // TLSF_DEBUG
@@ -49,6 +49,14 @@
 #  endif
 #endif
 
+/*
+ * log2 of the maximum allocation size. Overridable per translation
+ * unit: together with TLSF_PREFIX, tlsf.c can be compiled a second
+ * time with a smaller shift to instantiate a compact specialization
+ * (the free-list table in the control block scales with it) next to
+ * the full-size one in the same binary.
+ */
+#ifndef TLSF_MAX_SHIFT
 #if __WORDSIZE == 64
 #  define TLSF_MAX_SHIFT 36 // 64G
 #elif __WORDSIZE == 32
@@ -56,15 +64,99 @@
 #else
 #  error __WORDSIZE must be 32 or 64
 #endif
+#endif
 
 // Maximum allocation size
 #define TLSF_MAX_SIZE  ((1ULL << TLSF_MAX_SHIFT) - sizeof (size_t))
 
+/*
+ * log2 of number of linear subdivisions of block sizes. Larger
+ * values require more memory in the control structure. Values of
+ * 4 or 5 are typical. Overridable alongside TLSF_MAX_SHIFT and
+ * TLSF_PREFIX to build a specialized variant.
+ */
+#ifndef SL_INDEX_COUNT_SHIFT
+#define SL_INDEX_COUNT_SHIFT 5
+#endif
+
+/*
+ * log2 of the alignment of all allocation sizes and addresses: every
+ * returned pointer is a multiple of this. The word size by default;
+ * overridable to 4 (16 bytes) or 5 (32 bytes) alongside TLSF_PREFIX
+ * for SIMD consumers whose loads want wider guarantees.
+ */
+#ifndef ALIGN_SIZE_SHIFT
+#if __WORDSIZE == 64
+#  define ALIGN_SIZE_SHIFT 3
+#else
+#  define ALIGN_SIZE_SHIFT 2
+#endif
+#endif
+
+/*
+ * Symbol prefix of a specialized variant. Every API function is
+ * renamed, so e.g. -DTLSF_PREFIX=tlsf_small_ -DTLSF_MAX_SHIFT=21
+ * yields tlsf_small_create etc. which link alongside the default
+ * symbols. ALIGN_SIZE_SHIFT (above) can be raised the same way
+ * for a variant whose every allocation is 16- or 32-byte aligned.
+ * A variant must be used through a header inclusion with the
+ * same defines; instances of different variants are not interchangeable.
+ */
+#ifdef TLSF_PREFIX
+#define TLSF_GLUE_(prefix, name) prefix##name
+#define TLSF_GLUE(prefix, name)  TLSF_GLUE_(prefix, name)
+#define TLSF_NAME(name)          TLSF_GLUE(TLSF_PREFIX, name)
+
+#define tlsf_create         TLSF_NAME(create)
+#define tlsf_create_mmap    TLSF_NAME(create_mmap)
+#define tlsf_destroy        TLSF_NAME(destroy)
+#define tlsf_free           TLSF_NAME(free)
+#define tlsf_mallocx        TLSF_NAME(mallocx)
+#define tlsf_reallocx       TLSF_NAME(reallocx)
+#define tlsf_memalignx      TLSF_NAME(memalignx)
+#define tlsf_usable_size    TLSF_NAME(usable_size)
+#define tlsf_mallocx_ex     TLSF_NAME(mallocx_ex)
+#define tlsf_malloc_class   TLSF_NAME(malloc_class)
+#define tlsf_malloc_bulk    TLSF_NAME(malloc_bulk)
+#define tlsf_free_bulk      TLSF_NAME(free_bulk)
+#define tlsf_defer          TLSF_NAME(defer)
+#define tlsf_flush          TLSF_NAME(flush)
+#define tlsf_reserve        TLSF_NAME(reserve)
+#define tlsf_trim           TLSF_NAME(trim)
+#define tlsf_decommit       TLSF_NAME(decommit)
+#define tlsf_free_all       TLSF_NAME(free_all)
+#define tlsf_extend         TLSF_NAME(extend)
+#define tlsf_zeromap        TLSF_NAME(zeromap)
+#define tlsf_direct         TLSF_NAME(direct)
+#define tlsf_bestfit        TLSF_NAME(bestfit)
+#define tlsf_walk           TLSF_NAME(walk)
+#define tlsf_fragmentation  TLSF_NAME(fragmentation)
+#define tlsf_metrics        TLSF_NAME(metrics)
+#define tlsf_metrics_sample TLSF_NAME(metrics_sample)
+#define tlsf_free_remote    TLSF_NAME(free_remote)
+#define tlsf_trace_start    TLSF_NAME(trace_start)
+#define tlsf_trace_stop     TLSF_NAME(trace_stop)
+#define tlsf_stats          TLSF_NAME(stats)
+#define tlsf_printstats     TLSF_NAME(printstats)
+#define tlsf_class_stats    TLSF_NAME(class_stats)
+#define tlsf_check          TLSF_NAME(check)
+#define tlsf_check_step     TLSF_NAME(check_step)
+#define tlsf_group_create   TLSF_NAME(group_create)
+#define tlsf_group_destroy  TLSF_NAME(group_destroy)
+#define tlsf_group_nodes    TLSF_NAME(group_nodes)
+#define tlsf_group_get      TLSF_NAME(group_get)
+#define tlsf_group_local    TLSF_NAME(group_local)
+#define tlsf_save           TLSF_NAME(save)
+#define tlsf_restore        TLSF_NAME(restore)
+#endif
+
 // Flags
 #define TLSF_DEFAULT 0
 #define TLSF_NOMAP   1
 #define TLSF_ZERO    2
 #define TLSF_INPLACE 4
+#define TLSF_GROW    8
+#define TLSF_HIGH    16
 
 #ifdef __cplusplus
 extern "C" {
@@ -75,11 +167,221 @@ typedef struct tlsf_s* tlsf_t;
 typedef void* (*tlsf_map_t)(size_t* size, void* user);
 typedef void  (*tlsf_unmap_t)(void* mem, size_t size, void* user);
 
+/*
+ * Try to grow the mapping at mem (currently size bytes) in place by at
+ * least want bytes. Returns the number of bytes added, 0 on failure.
+ */
+typedef size_t (*tlsf_extend_t)(void* mem, size_t size, size_t want,
+                                void* user);
+
 tlsf_t tlsf_create(tlsf_map_t map, tlsf_unmap_t unmap, void* user);
 void   tlsf_destroy(tlsf_t t);
+
+/*
+ * Convenience constructor with built-in mmap callbacks. Pool sizes
+ * are rounded to 2M so whole pools can be backed by huge pages:
+ * TLSF_MMAP_HUGETLB maps from the reserved huge page pool (falling
+ * back to regular pages when none are available), TLSF_MMAP_HUGEPAGE
+ * requests transparent huge pages with madvise. The instance is
+ * created with tlsf_zeromap enabled, since anonymous mappings are
+ * zero filled.
+ */
+#define TLSF_MMAP_HUGETLB  1
+#define TLSF_MMAP_HUGEPAGE 2
+
+tlsf_t tlsf_create_mmap(int flags);
 void   tlsf_free(tlsf_t t, void* mem);
+/*
+ * TLSF_HIGH carves the allocation from the high-address end of the
+ * largest free block instead of the low end of the snuggest one.
+ * Allocating long-lived objects with it and transient ones without
+ * pushes the two kinds to opposite ends of each pool, so scratch
+ * holes are not pinned between session objects and coalesce back
+ * into large extents.
+ */
 void*  tlsf_mallocx(tlsf_t t, size_t size, int flags);
 void*  tlsf_reallocx(tlsf_t t, void* mem, size_t size, int flags);
+void*  tlsf_memalignx(tlsf_t t, size_t align, size_t size, int flags);
+
+/*
+ * The granted size of an allocated block, which may exceed the
+ * requested size. tlsf_mallocx_ex returns it alongside the pointer, so
+ * growable buffers can use the slack before calling realloc. Note that
+ * TLSF_ZERO only zeroes the requested size, not the whole block.
+ */
+size_t tlsf_usable_size(tlsf_t t, void* mem);
+void*  tlsf_mallocx_ex(tlsf_t t, size_t size, int flags, size_t* usable);
+
+/*
+ * Batch interface. tlsf_malloc_bulk allocates count blocks of the same
+ * size, carving them out of as few free blocks as possible, and returns
+ * the number of blocks actually allocated (< count only if memory is
+ * exhausted). tlsf_free_bulk frees count blocks in one call.
+ */
+size_t tlsf_malloc_bulk(tlsf_t t, size_t size, void** out, size_t count,
+                        int flags);
+void   tlsf_free_bulk(tlsf_t t, void** mem, size_t count);
+
+/*
+ * Deferred coalescing. With defer enabled, tlsf_free only pushes the
+ * block onto a pending list instead of merging it with its neighbors.
+ * tlsf_flush performs the postponed coalescing in one batch; it is also
+ * run automatically when an allocation would otherwise map a new pool.
+ */
+void tlsf_defer(tlsf_t t, int defer);
+void tlsf_flush(tlsf_t t);
+
+/*
+ * Unmap hysteresis. Up to pools empty pools are parked on a standby
+ * list instead of being returned through the unmap callback, and are
+ * revived before the map callback is invoked again. tlsf_trim releases
+ * the standby list when the memory should really go back.
+ */
+void tlsf_reserve(tlsf_t t, unsigned int pools);
+void tlsf_trim(tlsf_t t);
+
+/*
+ * Decommit the page-aligned interior of large free blocks with
+ * MADV_DONTNEED, starting from the largest size class, until at most
+ * keep bytes of free payload stay committed. The blocks remain linked
+ * in the free lists and usable; the pages fault back in (zeroed) on
+ * first touch. Returns the number of bytes returned to the kernel.
+ * This makes RSS elastic between load peaks without the map/unmap
+ * churn of tearing pools down.
+ */
+size_t tlsf_decommit(tlsf_t t, size_t keep);
+
+/*
+ * Abandon every live allocation at once and rebuild each pool as a
+ * single maximal free block, in O(pools) rather than O(allocations).
+ * All outstanding pointers become invalid. This turns an instance into
+ * a request-scoped arena: reset it between requests instead of paying
+ * for a destroy/create cycle or individual frees.
+ */
+void tlsf_free_all(tlsf_t t);
+
+/*
+ * Install an extend callback. When a request cannot be satisfied, the
+ * most recent pool is grown contiguously in place of mapping another
+ * discontiguous pool, absorbing its sentinel block into a new free
+ * block. Fewer, larger pools coalesce better and fragment less.
+ */
+void tlsf_extend(tlsf_t t, tlsf_extend_t extend);
+
+/*
+ * Declare that the map callback returns zeroed memory, as fresh
+ * anonymous mmap pages are. Blocks carved from pools mapped from then
+ * on are tracked as known zero, and TLSF_ZERO clears only the few
+ * words of allocator bookkeeping instead of the whole block.
+ */
+void tlsf_zeromap(tlsf_t t, int zeromap);
+
+/*
+ * Route allocations of at least threshold bytes to a dedicated mapping
+ * of their own instead of carving them from the segregated lists, so a
+ * multi-gigabyte buffer neither drags a huge pool into the free lists
+ * nor gets fragmented by small neighbors. Direct blocks may exceed
+ * TLSF_MAX_SIZE, are handed straight back through the unmap callback
+ * when freed, shrink in place and grow by copy on realloc. A threshold
+ * of zero disables the bypass (the default).
+ */
+void tlsf_direct(tlsf_t t, size_t threshold);
+
+/*
+ * Low-fragmentation policy: before escalating to a larger class, scan
+ * up to depth entries of the request's exact size class for the
+ * tightest fitting block. A close fit avoids splitting a larger block
+ * and costs a few cycles of bounded search per allocation, which slows
+ * external fragmentation growth on long-lived heaps. A depth of zero
+ * restores the pure good-fit policy (the default).
+ */
+void tlsf_bestfit(tlsf_t t, size_t depth);
+
+/*
+ * Heap introspection. tlsf_walk visits each pool (TLSF_WALK_POOL, with
+ * the total pool size) followed by every physical block it contains,
+ * in no particular pool order. tlsf_fragmentation summarizes the free
+ * blocks with a histogram by log2 size class. Both are safe to run on
+ * a live heap between requests; blocks parked in the small-block cache
+ * or on the deferred-free list are reported as used.
+ */
+#define TLSF_WALK_FREE 0
+#define TLSF_WALK_USED 1
+#define TLSF_WALK_POOL 2
+
+typedef void (*tlsf_walk_t)(void* mem, size_t size, int kind, void* user);
+
+void tlsf_walk(tlsf_t t, tlsf_walk_t walk, void* user);
+
+#define TLSF_FRAG_BUCKETS (TLSF_MAX_SHIFT + 2)
+
+typedef struct {
+  size_t pool_count;
+  size_t free_blocks;
+  size_t free_size;
+  size_t largest_free;
+  size_t free_hist[TLSF_FRAG_BUCKETS]; // Free blocks by log2 size class.
+} tlsf_frag_t;
+
+void tlsf_fragmentation(tlsf_t t, tlsf_frag_t* frag);
+
+#ifdef TLSF_MT
+/*
+ * Multi-threaded mode. Each thread owns its instance; all other
+ * operations stay single-threaded. A foreign thread returns memory with
+ * tlsf_free_remote, which pushes the block onto the owner's lock-free
+ * remote-free list. The owner drains the list on its next allocation.
+ */
+void tlsf_free_remote(tlsf_t t, void* mem);
+#endif
+
+/*
+ * Compiling with TLSF_LOCK guards every mutating entry point of an
+ * instance with a mutex, for lower-traffic consumers that want one
+ * shared heap instead of per-thread instances. Configuration calls
+ * (tlsf_defer aside) are not serialized; make them before sharing the
+ * instance. For scalable sharing prefer TLSF_MT with one instance per
+ * thread and tlsf_free_remote, which remains lock-free.
+ */
+
+/*
+ * Instance groups for NUMA machines: one instance per node, sharing
+ * one pair of callbacks that receive the node an instance serves, so
+ * the map callback can bind each pool to its node (mbind or
+ * numa_alloc_onnode). tlsf_group_local routes by the calling thread's
+ * current node; a block must be returned to the instance that
+ * allocated it, from a foreign node via tlsf_free_remote. The group
+ * header itself is mapped through the node-0 callback.
+ */
+typedef struct tlsf_group_s* tlsf_group_t;
+
+typedef void* (*tlsf_group_map_t)(size_t* size, unsigned int node,
+                                  void* user);
+typedef void  (*tlsf_group_unmap_t)(void* mem, size_t size,
+                                    unsigned int node, void* user);
+
+tlsf_group_t tlsf_group_create(unsigned int nodes, tlsf_group_map_t map,
+                               tlsf_group_unmap_t unmap, void* user);
+void tlsf_group_destroy(tlsf_group_t g);
+unsigned int tlsf_group_nodes(tlsf_group_t g);
+tlsf_t tlsf_group_get(tlsf_group_t g, unsigned int node);
+tlsf_t tlsf_group_local(tlsf_group_t g);
+
+/*
+ * Heap snapshot and restore. tlsf_save writes the control structure
+ * and every pool (parked standby pools included) to fd as a
+ * relocatable image; tlsf_restore maps the regions back through the
+ * given callbacks and fixes the embedded pointers up by per-region
+ * offsets. A map callback that replaces regions at their recorded
+ * addresses (MAP_FIXED) makes every fixup a no-op; either way the
+ * callback must return regions of the requested size, page rounding
+ * aside. Tracing must be stopped before saving, dedicated mappings
+ * made above the tlsf_direct threshold are not tracked and so not
+ * saved, and an extend callback must be registered again after
+ * restore. Both return -1/NULL on a short read, write or mapping.
+ */
+int tlsf_save(tlsf_t t, int fd);
+tlsf_t tlsf_restore(int fd, tlsf_map_t map, tlsf_unmap_t unmap, void* user);
 
 static inline void* tlsf_malloc(tlsf_t t, size_t size) {
   return tlsf_mallocx(t, size, TLSF_DEFAULT);
@@ -93,6 +395,107 @@ static inline void* tlsf_realloc(tlsf_t t, void* mem, size_t size) {
   return tlsf_reallocx(t, mem, size, TLSF_DEFAULT);
 }
 
+static inline void* tlsf_memalign(tlsf_t t, size_t align, size_t size) {
+  return tlsf_memalignx(t, align, size, TLSF_DEFAULT);
+}
+
+/*
+ * Specialized path for allocation sites whose size is a compile-time
+ * constant. tlsf_size_class mirrors the internal size adjustment,
+ * rounding and (fl, sl) mapping, so with a constant size the whole
+ * computation folds away and tlsf_malloc_class is left with a cache
+ * probe or a list head pop - no size arithmetic, no bit scans. The
+ * handle packs the adjusted size with the class indices; compute it
+ * under the same defines as the instance it is used with, and only
+ * for sizes below 1 << (__WORDSIZE - 12).
+ */
+void* tlsf_malloc_class(tlsf_t t, size_t cls);
+
+static inline size_t tlsf_size_class(size_t size) {
+  const size_t align = (size_t)1 << ALIGN_SIZE_SHIFT;
+  const size_t small = (size_t)1 << (SL_INDEX_COUNT_SHIFT + ALIGN_SIZE_SHIFT);
+
+  // Sizes are kept a word short of a multiple of the alignment, and
+  // no smaller than a free block header.
+  size_t adjusted = ((size + sizeof (size_t) + align - 1) & ~(align - 1))
+    - sizeof (size_t);
+  if (adjusted < 3 * sizeof (size_t))
+    adjusted = 3 * sizeof (size_t);
+
+  size_t fl = 0;
+  size_t sl = adjusted >> ALIGN_SIZE_SHIFT;
+  if (adjusted >= small) {
+    // The class of the request rounded up to the next block size, so
+    // every block in it is large enough.
+    const size_t rounded = adjusted
+      + ((size_t)1 << (8 * sizeof (size_t) - 1
+                       - (size_t)__builtin_clzll(adjusted)
+                       - SL_INDEX_COUNT_SHIFT)) - 1;
+    const size_t f = 8 * sizeof (size_t) - 1 - (size_t)__builtin_clzll(rounded);
+    sl = (rounded >> (f - SL_INDEX_COUNT_SHIFT))
+      ^ ((size_t)1 << SL_INDEX_COUNT_SHIFT);
+    fl = f - (SL_INDEX_COUNT_SHIFT + ALIGN_SIZE_SHIFT - 1);
+  }
+  return (adjusted << 12) | (fl << 6) | sl;
+}
+
+/*
+ * Always-available instrumentation. With a sample interval of N, every
+ * Nth tlsf_mallocx/tlsf_free is timed with the cycle counter into a
+ * log2 histogram; the unsampled path only pays a decrement and branch.
+ * The slow-path counters are always maintained. An interval of 0
+ * (the default) disables sampling.
+ */
+#define TLSF_METRICS_BUCKETS 32
+
+typedef struct {
+  // Sampled log2(cycles) histograms.
+  size_t malloc_hist[TLSF_METRICS_BUCKETS];
+  size_t free_hist[TLSF_METRICS_BUCKETS];
+  size_t malloc_samples;
+  size_t free_samples;
+
+  // Slow-path counters.
+  size_t map_calls;
+  size_t search_escalations;
+  size_t realloc_copies;
+} tlsf_metrics_t;
+
+const tlsf_metrics_t* tlsf_metrics(tlsf_t t);
+void tlsf_metrics_sample(tlsf_t t, size_t interval);
+
+#ifdef TLSF_TRACE
+/*
+ * Allocation trace recording. Events are buffered in a per-instance
+ * ring and flushed to fd as fixed-size binary records; see build/replay
+ * for a tool that replays a recorded trace. Reallocs that delegate to
+ * malloc/free are recorded as those primitive events.
+ */
+#define TLSF_TRACE_MAGIC   0x46534c54u // "TLSF"
+#define TLSF_TRACE_VERSION 1
+
+#define TLSF_TRACE_MALLOC   1
+#define TLSF_TRACE_FREE     2
+#define TLSF_TRACE_REALLOC  3
+#define TLSF_TRACE_FREE_ALL 4
+
+typedef struct {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int wordsize;
+  unsigned int pad;
+} tlsf_trace_header_t;
+
+typedef struct {
+  size_t size_op; // Operation in the top byte, request size below.
+  size_t ptr;     // Affected block (the result for malloc).
+  size_t ptr2;    // Resulting block for realloc.
+} tlsf_trace_event_t;
+
+int  tlsf_trace_start(tlsf_t t, int fd);
+void tlsf_trace_stop(tlsf_t t);
+#endif
+
 #ifdef TLSF_STATS
 typedef struct {
   size_t free_size;
@@ -105,12 +508,34 @@ typedef struct {
 
 const tlsf_stats_t* tlsf_stats(tlsf_t t);
 void tlsf_printstats(tlsf_t t);
+
+/*
+ * Per size class search outcome, for tuning the second-level
+ * subdivision empirically. A hit found a free block in the exact
+ * (fl, sl) class of the rounded request; a miss escalated to a larger
+ * class, which costs a split and leaves a fragment behind. Returns 0
+ * once fl or sl runs past the class geometry, so callers can iterate
+ * without knowing the configured index counts.
+ */
+int tlsf_class_stats(tlsf_t t, unsigned int fl, unsigned int sl,
+                     size_t* hits, size_t* misses);
 #endif
 
 #ifdef TLSF_DEBUG
 void tlsf_check(tlsf_t t);
 #endif
 
+/*
+ * Incremental integrity check for production use. Validates at most
+ * budget blocks per call and remembers its position, so the cost of a
+ * full verification can be spread across many calls on a live heap -
+ * a few blocks per event-loop tick catches corruption long before it
+ * is tripped over. Returns 0 if the step found no problems, 1 if it
+ * also completed a full sweep, and -1 if the heap is corrupt (the
+ * sweep then restarts from the beginning).
+ */
+int tlsf_check_step(tlsf_t t, size_t budget);
+
 #ifdef __cplusplus
 }
 #endif